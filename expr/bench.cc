@@ -0,0 +1,217 @@
+/*
+ * bench.cc
+ *
+ * Throughput and compile latency of the expr JIT, as CSV.
+ */
+
+#include <sys/time.h>
+
+#include "lang.hh"
+
+typedef void (*stream_func)(const float*, const float*, float*, size_t);
+typedef float (*reduce_func)(const float*, const float*, size_t);
+
+struct BenchCase {
+	const char* name;
+	const char* defs;
+	const char* expr;
+};
+
+static const BenchCase corpus[] = {
+	{ "add", "", "(+ x y)" },
+	{ "arith", "", "(+ (* x y) (- x y) (/ x 3))" },
+	{ "chain", "", "(* (+ x 1) (+ x 2) (+ x 3) (+ x 4) (+ y 5))" },
+	{ "sqrt", "", "(sqrt x)" },
+	{ "sin", "", "(sin x)" },
+	{ "cos", "", "(cos x)" },
+	{ "exp", "", "(exp x)" },
+	{ "log", "", "(log x)" },
+	{ "pow", "", "(pow x y)" },
+	{ "nested",
+		"(def sq (x) (* x x))"
+		"(def norm (x y) (sqrt (+ (sq x) (sq y))))"
+		"(def unit (x y) (/ x (norm x y)))",
+		"(+ (unit x y) (unit y x))" },
+	{ "tan",
+		"(def tan (x) (/ (sin x) (cos x)))",
+		"(tan (exp x))" },
+	{ "magic",
+		"(def magic (x y)"
+		"  (* (/ (sin x)"
+		"        (cos x))"
+		"     (pow x y)))",
+		"(magic x y)" },
+};
+
+/* Reductions over the same inputs, with no result array. */
+static const BenchCase reductions[] = {
+	{ "sum", "", "(sum x)" },
+	{ "dot", "", "(dot x y)" },
+	{ "max_sin", "", "(max (sin x))" },
+	{ "mean_norm", "", "(mean (sqrt (+ (* x x) (* y y))))" },
+};
+
+static double now() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/* Feeds 'defs' to the JIT one top-level form at a time. */
+static void define(JITMachine& machine, string defs) {
+	vector<string> forms = split_forms(defs);
+	for (unsigned i=0; i < forms.size(); ++i) {
+		machine.jit_internal(forms[i]);
+	}
+}
+
+/* Best of several timed runs, in millions of elements per second. */
+static double throughput(JITMachine& machine, stream_func fn, bool batch,
+	const float* x, const float* y, float* out, size_t n)
+{
+	double best = 0;
+	for (int trial=0; trial < 5; ++trial) {
+		size_t done = 0;
+		double start = now(), elapsed;
+		do {
+			if (batch) {
+				vector<const float*> ins;
+				ins.push_back(x);
+				ins.push_back(y);
+				machine.run_batch((void*) fn, ins, out, n);
+			} else {
+				fn(x, y, out, n);
+			}
+			done += n;
+			elapsed = now() - start;
+		} while (elapsed < 0.05);
+		best = max(best, done / elapsed / 1e6);
+	}
+	return best;
+}
+
+static double reduce_throughput(JITMachine& machine, reduce_func fn,
+	bool batch, const float* x, const float* y, size_t n)
+{
+	double best = 0;
+	volatile float sink;
+	for (int trial=0; trial < 5; ++trial) {
+		size_t done = 0;
+		double start = now(), elapsed;
+		do {
+			if (batch) {
+				vector<const float*> ins;
+				ins.push_back(x);
+				ins.push_back(y);
+				sink = machine.run_reduce((void*) fn, ins, n);
+			} else {
+				sink = fn(x, y, n);
+			}
+			done += n;
+			elapsed = now() - start;
+		} while (elapsed < 0.05);
+		best = max(best, done / elapsed / 1e6);
+	}
+	(void) sink;
+	return best;
+}
+
+int main(int argc, const char* argv[]) {
+	unsigned lanes = 0;
+	math_tier_t tier = MATH_LIBM;
+	bool fast_math = false;
+	int inline_threshold = -1;
+	size_t sizes[] = { 1 << 12, 1 << 24 };
+	for (int i=1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "-lanes" && i + 1 < argc) {
+			lanes = atoi(argv[++i]);
+		} else if (arg == "-inline" && i + 1 < argc) {
+			inline_threshold = atoi(argv[++i]);
+		} else if (arg == "-fast-math") {
+			fast_math = true;
+		} else if (arg == "-math" && i + 1 < argc) {
+			string mode = argv[++i];
+			if (mode == "precise") {
+				tier = MATH_PRECISE;
+			} else if (mode == "fast") {
+				tier = MATH_FAST;
+			}
+		}
+	}
+
+	/* Positive inputs keep log and pow in their domains. */
+	size_t largest = sizes[1];
+	vector<float> x(largest), y(largest), out(largest);
+	for (size_t i=0; i < largest; ++i) {
+		x[i] = 0.1 + (i % 1000) * 0.0019;
+		y[i] = 0.5 + (i % 777) * 0.0032;
+	}
+
+	vector<string> params;
+	params.push_back("x");
+	params.push_back("y");
+
+	cout << "name,elements,lanes,compile_ms,single_melem_s,batch_melem_s"
+		<< endl;
+	for (unsigned c=0; c < sizeof(corpus) / sizeof(corpus[0]); ++c) {
+		/* A fresh machine each time, so nothing comes from a cache. */
+		JITMachine machine(lanes);
+		machine.set_math_tier(tier);
+		machine.set_fast_math(fast_math);
+		if (inline_threshold >= 0) {
+			machine.set_inline_threshold(inline_threshold);
+		}
+		define(machine, corpus[c].defs);
+
+		double start = now();
+		stream_func fn = stream_func(machine.jit_external_stream_expr(
+			corpus[c].expr, params));
+		double compile_ms = (now() - start) * 1e3;
+		if (!fn) {
+			cerr << corpus[c].name << ": failed to compile" << endl;
+			continue;
+		}
+
+		for (unsigned s=0; s < 2; ++s) {
+			size_t n = sizes[s];
+			double single = throughput(machine, fn, false,
+				&x[0], &y[0], &out[0], n);
+			double batch = throughput(machine, fn, true,
+				&x[0], &y[0], &out[0], n);
+			cout << corpus[c].name << "," << n << ","
+				<< machine.jit->lanes << "," << compile_ms << ","
+				<< single << "," << batch << endl;
+		}
+	}
+
+	for (unsigned c=0; c < sizeof(reductions) / sizeof(reductions[0]); ++c) {
+		JITMachine machine(lanes);
+		machine.set_math_tier(tier);
+		machine.set_fast_math(fast_math);
+		if (inline_threshold >= 0) {
+			machine.set_inline_threshold(inline_threshold);
+		}
+
+		double start = now();
+		reduce_func fn = reduce_func(machine.jit_reduce_expr(
+			reductions[c].expr, params));
+		double compile_ms = (now() - start) * 1e3;
+		if (!fn) {
+			cerr << reductions[c].name << ": failed to compile" << endl;
+			continue;
+		}
+
+		for (unsigned s=0; s < 2; ++s) {
+			size_t n = sizes[s];
+			double single = reduce_throughput(machine, fn, false,
+				&x[0], &y[0], n);
+			double batch = reduce_throughput(machine, fn, true,
+				&x[0], &y[0], n);
+			cout << reductions[c].name << "," << n << ","
+				<< machine.jit->lanes << "," << compile_ms << ","
+				<< single << "," << batch << endl;
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,278 @@
+/*
+ * diff.cc
+ *
+ * Forward-mode differentiation of expressions, as more expressions.
+ */
+
+#include "lang.hh"
+
+Differentiator::Differentiator(JIT* jit, ASTArena& arena)
+	: _jit(jit), _arena(arena), _failed(false)
+{}
+
+/* Definitions are parsed again from source, as the interpreter does. */
+ASTDef* Differentiator::definition(StringRef name) {
+	ASTDef* defn = _defs.lookup(name);
+	if (defn) {
+		return defn;
+	}
+	string source = _jit->defs->source(name);
+	ASTNode* ast = source.empty() ? NULL : Parser(source, _arena).parse();
+	defn = ast ? dynamic_cast<ASTDef*>(ast) : NULL;
+	if (defn) {
+		defn = static_cast<ASTDef*>(_arena.simplify(defn, _jit));
+		_defs[name] = defn;
+	}
+	return defn;
+}
+
+ASTNode* Differentiator::expand(ASTNode* node, Scope& scope) {
+	DenseMap<ASTNode*, ASTNode*>::iterator found = scope.done.find(node);
+	if (found != scope.done.end()) {
+		return found->second;
+	}
+
+	ASTNode* result = node;
+	ASTVar* var = dynamic_cast<ASTVar*>(node);
+	ASTCall* call = dynamic_cast<ASTCall*>(node);
+	if (var) {
+		/* Names a definition leaves unbound are zero, as in code
+		 * generation, not whatever the caller calls by that name. */
+		result = scope.vars.lookup(var->ident);
+		if (!result) {
+			result = number(0);
+		}
+	} else if (call) {
+		ASTCall::arg_list args;
+		bool changed = false;
+		ASTCall::arg_list::iterator it = call->args.begin();
+		for (; it != call->args.end(); ++it) {
+			args.push_back(expand(*it, scope));
+			changed = changed || args.back() != *it;
+		}
+
+		ASTDef* defn = _jit->builtin(call->name, args.size()) ? NULL
+			: definition(call->name);
+		if (defn) {
+			/* Calls are inlined, so their bodies differentiate in
+			 * terms of the caller's parameters. */
+			if (defn->params.size() != args.size()) {
+				_failed = true;
+				return node;
+			}
+			Scope inner;
+			for (unsigned i=0; i < args.size(); ++i) {
+				inner.vars[defn->params[i]] = args[i];
+			}
+			result = expand(defn->body, inner);
+		} else if (changed) {
+			ASTCall* copy = new (_arena) ASTCall(call->name);
+			copy->args = args;
+			result = copy;
+		}
+	} else if (!dynamic_cast<ASTNumber*>(node)) {
+		_failed = true;
+	}
+	scope.done[node] = result;
+	return result;
+}
+
+ASTNode* Differentiator::expand(ASTDef* defn) {
+	Scope scope;
+	for (unsigned i=0; i < defn->params.size(); ++i) {
+		scope.vars[defn->params[i]] = new (_arena) ASTVar(
+			_arena.intern(defn->params[i]));
+	}
+	return expand(defn->body, scope);
+}
+
+ASTNode* Differentiator::number(double num) {
+	return new (_arena) ASTNumber(num);
+}
+
+ASTNode* Differentiator::call(StringRef name, ASTNode* a, ASTNode* b,
+	ASTNode* c)
+{
+	ASTCall* node = new (_arena) ASTCall(name);
+	node->args.push_back(a);
+	if (b) {
+		node->args.push_back(b);
+	}
+	if (c) {
+		node->args.push_back(c);
+	}
+	return node;
+}
+
+/* Tangents of NULL are zero, and propagate as such. */
+ASTNode* Differentiator::add(ASTNode* a, ASTNode* b) {
+	return !a ? b : !b ? a : call("+", a, b);
+}
+
+ASTNode* Differentiator::sub(ASTNode* a, ASTNode* b) {
+	return !b ? a : !a ? call("*", number(-1), b) : call("-", a, b);
+}
+
+ASTNode* Differentiator::mul(ASTNode* a, ASTNode* b) {
+	return (a && b) ? call("*", a, b) : NULL;
+}
+
+ASTNode* Differentiator::div(ASTNode* a, ASTNode* b) {
+	return a ? call("/", a, b) : NULL;
+}
+
+ASTNode* Differentiator::orZero(ASTNode* tangent) {
+	return tangent ? tangent : number(0);
+}
+
+ASTNode* Differentiator::tangent(ASTNode* node, StringRef wrt) {
+	_tangents.clear();
+	_wrt = wrt;
+	return orZero(derive(node));
+}
+
+/* Each node's tangent is built once, from its operands' values and
+ * tangents, so tangents share the value's nodes and each other's. */
+ASTNode* Differentiator::derive(ASTNode* node) {
+	DenseMap<ASTNode*, ASTNode*>::iterator found = _tangents.find(node);
+	if (found != _tangents.end()) {
+		return found->second;
+	}
+
+	ASTNode* result = NULL;
+	ASTVar* var = dynamic_cast<ASTVar*>(node);
+	ASTCall* node_call = dynamic_cast<ASTCall*>(node);
+	if (var) {
+		result = (var->ident == _wrt) ? number(1) : NULL;
+	} else if (node_call) {
+		result = deriveCall(node_call);
+	}
+	_tangents[node] = result;
+	return result;
+}
+
+ASTNode* Differentiator::deriveCall(ASTCall* node) {
+	StringRef name = node->name;
+	ASTCall::arg_list& args = node->args;
+
+	/* Expanding leaves only builtins; anything else, such as (g),
+	 * is a call nothing defines. */
+	if (args.empty() || !_jit->builtin(name, args.size())) {
+		_failed = true;
+		return NULL;
+	}
+	vector<ASTNode*> ts;
+	for (unsigned i=0; i < args.size(); ++i) {
+		ts.push_back(derive(args[i]));
+	}
+	ASTNode* u = args[0];
+	ASTNode* tu = ts[0];
+
+	if (name == "+") {
+		ASTNode* t = NULL;
+		for (unsigned i=0; i < ts.size(); ++i) {
+			t = add(t, ts[i]);
+		}
+		return t;
+	} else if (name == "-") {
+		ASTNode* t = tu;
+		for (unsigned i=1; i < ts.size(); ++i) {
+			t = sub(t, ts[i]);
+		}
+		return t;
+	} else if (name == "*" || name == "/") {
+		/* Left to right, as the product or quotient is computed;
+		 * (u/v)' = (u' - (u/v) v') / v reuses the quotient. */
+		bool product = (name == "*");
+		ASTNode* v = u;
+		ASTNode* t = tu;
+		for (unsigned i=1; i < args.size(); ++i) {
+			ASTNode* next = (i + 1 == args.size()) ? node
+				: call(name, v, args[i]);
+			t = product ? add(mul(t, args[i]), mul(v, ts[i]))
+				: div(sub(t, mul(next, ts[i])), args[i]);
+			v = next;
+		}
+		return t;
+	} else if (name == "sqrt") {
+		return div(tu, call("*", number(2), node));
+	} else if (name == "sin") {
+		return mul(call("cos", u), tu);
+	} else if (name == "cos") {
+		return sub(NULL, mul(call("sin", u), tu));
+	} else if (name == "exp") {
+		return mul(node, tu);
+	} else if (name == "log") {
+		return div(tu, u);
+	} else if (name == "pow" || name == "pow.int") {
+		/* (u^v)' = v u^(v-1) u' + u^v log(u) v' */
+		ASTNode* v = args[1];
+		ASTNumber* exponent = dynamic_cast<ASTNumber*>(v);
+		ASTNode* t = NULL;
+		if (tu && exponent) {
+			double n = exponent->num;
+			StringRef power = (name == "pow.int" && n >= 1) ? name : "pow";
+			t = mul(call("*", v, call(power, u, number(n - 1))), tu);
+		} else if (tu) {
+			t = mul(call("/", call("*", v, node), u), tu);
+		}
+		if (ts[1]) {
+			t = add(t, mul(call("*", node, call("log", u)), ts[1]));
+		}
+		return t;
+	} else if (name == "fma") {
+		return add(add(mul(tu, args[1]), mul(u, ts[1])), ts[2]);
+	} else if (name == "if" || name == "select") {
+		if (!ts[1] && !ts[2]) {
+			return NULL;
+		}
+		return call(name, u, orZero(ts[1]), orZero(ts[2]));
+	} else if (name == "min" || name == "max") {
+		/* Whichever operand is taken, its tangent: as emit_min and
+		 * emit_max, a later operand only when strictly past. */
+		StringRef cmp = (name == "min") ? "<" : ">";
+		ASTNode* v = u;
+		ASTNode* t = tu;
+		for (unsigned i=1; i < args.size(); ++i) {
+			if (t || ts[i]) {
+				t = call("if", call(cmp, args[i], v), orZero(ts[i]),
+					orZero(t));
+			}
+			v = (i + 1 == args.size()) ? node : call(name, v, args[i]);
+		}
+		return t;
+	} else if (name == "swizzle" || name == "broadcast"
+		|| name == "hsum")
+	{
+		/* Linear in their vector: the same lanes of its tangent. */
+		if (!tu) {
+			return NULL;
+		}
+		ASTCall* copy = new (_arena) ASTCall(name);
+		copy->args = args;
+		copy->args[0] = tu;
+		return copy;
+	} else if (name == "shuffle") {
+		if (!tu && !ts[1]) {
+			return NULL;
+		}
+		ASTCall* copy = new (_arena) ASTCall(name);
+		copy->args = args;
+		copy->args[0] = orZero(tu);
+		copy->args[1] = orZero(ts[1]);
+		return copy;
+	} else if (name == "dot4") {
+		ASTNode* t = tu ? call("dot4", tu, args[1]) : NULL;
+		return add(t, ts[1] ? call("dot4", u, ts[1]) : NULL);
+	} else if (name == "abs") {
+		return tu ? call("if", call("<", u, number(0)),
+			sub(NULL, tu), tu) : NULL;
+	} else if (name == "floor" || name == "<" || name == "<="
+		|| name == ">" || name == ">=" || name == "=" || name == "!=")
+	{
+		/* Flat almost everywhere. */
+		return NULL;
+	}
+	_failed = true;
+	return NULL;
+}
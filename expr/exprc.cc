@@ -0,0 +1,146 @@
+/*
+ * exprc.cc
+ *
+ * Compiles a file of definitions ahead of time, into an object file
+ * or shared library and a C header declaring its kernels.
+ */
+
+#include "lang.hh"
+
+static void usage() {
+	cerr << "usage: exprc [-lanes N] [-math precise|fast] [-fast-math]"
+		" [-inline N]\n"
+		"             [-precision f32|f64|f16] [-vector] [-header out.h]\n"
+		"             -o out.o|out.so defs.expr\n";
+}
+
+static bool ends_with(const string& str, const string& suffix) {
+	return str.size() >= suffix.size()
+		&& str.compare(str.size() - suffix.size(), suffix.size(),
+			suffix) == 0;
+}
+
+/* out.so => out.h */
+static string header_path(const string& output) {
+	size_t dot = output.rfind('.');
+	size_t slash = output.rfind('/');
+	if (dot == string::npos || (slash != string::npos && dot < slash)) {
+		return output + ".h";
+	}
+	return output.substr(0, dot) + ".h";
+}
+
+static bool write_header(const string& path, const string& input,
+	const vector<string>& decls, bool vectors, unsigned lanes)
+{
+	string guard = path.substr(path.rfind('/') + 1);
+	for (size_t i=0; i < guard.size(); ++i) {
+		guard[i] = isalnum(guard[i]) ? toupper(guard[i]) : '_';
+	}
+
+	ofstream out(path.c_str());
+	out << "/* Generated by exprc from " << input
+		<< "; do not edit. */\n\n"
+		<< "#ifndef " << guard << "\n#define " << guard << "\n\n"
+		<< "#include <stddef.h>\n#include <stdint.h>\n\n"
+		<< "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n";
+	if (vectors) {
+		out << "/* Each array holds " << lanes << " elements. */\n";
+	}
+	for (unsigned i=0; i < decls.size(); ++i) {
+		out << decls[i] << "\n";
+	}
+	out << "\n#ifdef __cplusplus\n}\n#endif\n\n#endif\n";
+	out.close();
+	return out.good();
+}
+
+int main(int argc, const char* argv[]) {
+	unsigned lanes = 0;
+	math_tier_t tier = MATH_LIBM;
+	bool fast_math = false;
+	int inline_threshold = -1;
+	precision_t precision = PRECISION_F32;
+	bool vectors = false;
+	string output, header, input;
+	for (int i=1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "-lanes" && i + 1 < argc) {
+			lanes = atoi(argv[++i]);
+		} else if (arg == "-inline" && i + 1 < argc) {
+			inline_threshold = atoi(argv[++i]);
+		} else if (arg == "-fast-math") {
+			fast_math = true;
+		} else if (arg == "-math" && i + 1 < argc) {
+			string mode = argv[++i];
+			if (mode == "precise") {
+				tier = MATH_PRECISE;
+			} else if (mode == "fast") {
+				tier = MATH_FAST;
+			}
+		} else if (arg == "-precision" && i + 1 < argc) {
+			string prec = argv[++i];
+			if (prec == "f64") {
+				precision = PRECISION_F64;
+			} else if (prec == "f16") {
+				precision = PRECISION_F16;
+			}
+		} else if (arg == "-vector") {
+			vectors = true;
+		} else if (arg == "-header" && i + 1 < argc) {
+			header = argv[++i];
+		} else if (arg == "-o" && i + 1 < argc) {
+			output = argv[++i];
+		} else {
+			input = arg;
+		}
+	}
+	if (output.empty() || input.empty()) {
+		usage();
+		return 2;
+	}
+	if (header.empty()) {
+		header = header_path(output);
+	}
+
+	ifstream in(input.c_str());
+	if (!in) {
+		cerr << input << ": cannot read" << endl;
+		return 1;
+	}
+	string source((istreambuf_iterator<char>(in)),
+		istreambuf_iterator<char>());
+
+	JITMachine machine(lanes);
+	machine.set_math_tier(tier);
+	machine.set_fast_math(fast_math);
+	machine.set_precision(precision);
+	if (inline_threshold >= 0) {
+		machine.set_inline_threshold(inline_threshold);
+	}
+
+	/* A shared library is linked from an object beside it. */
+	bool shared = ends_with(output, ".so");
+	string object = shared ? output + ".o" : output;
+	vector<string> decls;
+	if (!machine.jit_object(split_forms(source), object, vectors, decls)) {
+		cerr << input << ": failed to compile" << endl;
+		return 1;
+	}
+	if (shared) {
+		bool linked = link_shared(object, output);
+		unlink(object.c_str());
+		if (!linked) {
+			cerr << output << ": failed to link" << endl;
+			return 1;
+		}
+	}
+
+	if (!write_header(header, input, decls, vectors,
+		machine.jit->lanes))
+	{
+		cerr << header << ": cannot write" << endl;
+		return 1;
+	}
+	return 0;
+}
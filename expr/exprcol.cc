@@ -0,0 +1,216 @@
+/*
+ * exprcol.cc
+ *
+ * Evaluates expressions over binary column files of any size, mapped
+ * a window at a time.
+ */
+
+#include "lang.hh"
+#include <fcntl.h>
+#include <sys/mman.h>
+
+/* Bytes of each column in memory at once. */
+static const size_t window_bytes = 1 << 25;
+
+static void usage() {
+	cerr << "usage: exprcol [-lanes N] [-math precise|fast] [-fast-math]"
+		" [-inline N]\n"
+		"               [-precision f32|f64|f16]"
+		" -e expr -o out.bin [-e expr -o out.bin ...]\n"
+		"               name=column.bin ...\n";
+}
+
+struct Column {
+	string path;
+	int fd;
+	char* data;	/* the whole file, for inputs */
+	size_t bytes;
+
+	Column(string _path)
+		: path(_path), fd(-1), data(NULL), bytes(0)
+	{}
+};
+
+static bool map_input(Column& col) {
+	col.fd = open(col.path.c_str(), O_RDONLY);
+	struct stat st;
+	if (col.fd < 0 || fstat(col.fd, &st) != 0) {
+		return false;
+	}
+	col.bytes = st.st_size;
+	if (!col.bytes) {
+		return true;
+	}
+	void* data = mmap(NULL, col.bytes, PROT_READ, MAP_SHARED, col.fd, 0);
+	if (data == MAP_FAILED) {
+		return false;
+	}
+	col.data = (char*) data;
+	madvise(col.data, col.bytes, MADV_SEQUENTIAL);
+	return true;
+}
+
+static bool create_output(Column& col, size_t bytes) {
+	col.fd = open(col.path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	col.bytes = bytes;
+	return col.fd >= 0 && ftruncate(col.fd, bytes) == 0;
+}
+
+static void close_column(Column& col) {
+	if (col.data) {
+		munmap(col.data, col.bytes);
+	}
+	if (col.fd >= 0) {
+		close(col.fd);
+	}
+}
+
+/* Reads the next window ahead while this one is computed, and lets
+ * the last one go, so only about two windows per column are resident. */
+static void advise(vector<Column>& ins, size_t begin, size_t window,
+	size_t total)
+{
+	for (unsigned i=0; i < ins.size(); ++i) {
+		size_t next = begin + window;
+		if (next < total) {
+			madvise(ins[i].data + next, min(window, total - next),
+				MADV_WILLNEED);
+		}
+		if (begin) {
+			madvise(ins[i].data + begin - window, window,
+				MADV_DONTNEED);
+		}
+	}
+}
+
+int main(int argc, const char* argv[]) {
+	unsigned lanes = 0;
+	math_tier_t tier = MATH_LIBM;
+	bool fast_math = false;
+	int inline_threshold = -1;
+	precision_t precision = PRECISION_F32;
+	vector<string> exprs, params;
+	vector<Column> ins, outs;
+	for (int i=1; i < argc; ++i) {
+		string arg = argv[i];
+		size_t eq = arg.find('=');
+		if (arg == "-lanes" && i + 1 < argc) {
+			lanes = atoi(argv[++i]);
+		} else if (arg == "-inline" && i + 1 < argc) {
+			inline_threshold = atoi(argv[++i]);
+		} else if (arg == "-fast-math") {
+			fast_math = true;
+		} else if (arg == "-math" && i + 1 < argc) {
+			string mode = argv[++i];
+			if (mode == "precise") {
+				tier = MATH_PRECISE;
+			} else if (mode == "fast") {
+				tier = MATH_FAST;
+			}
+		} else if (arg == "-precision" && i + 1 < argc) {
+			string prec = argv[++i];
+			if (prec == "f64") {
+				precision = PRECISION_F64;
+			} else if (prec == "f16") {
+				precision = PRECISION_F16;
+			}
+		} else if (arg == "-e" && i + 1 < argc) {
+			exprs.push_back(argv[++i]);
+		} else if (arg == "-o" && i + 1 < argc) {
+			outs.push_back(Column(argv[++i]));
+		} else if (eq != string::npos && eq > 0) {
+			params.push_back(arg.substr(0, eq));
+			ins.push_back(Column(arg.substr(eq + 1)));
+		} else {
+			usage();
+			return 2;
+		}
+	}
+	if (exprs.empty() || exprs.size() != outs.size() || ins.empty()) {
+		usage();
+		return 2;
+	}
+
+	JITMachine machine(lanes);
+	machine.set_math_tier(tier);
+	machine.set_fast_math(fast_math);
+	machine.set_precision(precision);
+	if (inline_threshold >= 0) {
+		machine.set_inline_threshold(inline_threshold);
+	}
+	void* kernel = machine.jit_external_stream_exprs(exprs, params);
+	if (!kernel) {
+		cerr << "failed to compile" << endl;
+		return 1;
+	}
+
+	/* Every column holds the same number of elements. */
+	size_t elt_bytes = (precision == PRECISION_F64) ? sizeof(double)
+		: (precision == PRECISION_F16) ? sizeof(uint16_t) : sizeof(float);
+	size_t total = 0;
+	for (unsigned i=0; i < ins.size(); ++i) {
+		if (!map_input(ins[i])) {
+			cerr << ins[i].path << ": cannot map" << endl;
+			return 1;
+		}
+		if (i && ins[i].bytes != total) {
+			cerr << ins[i].path << ": length differs" << endl;
+			return 1;
+		}
+		total = ins[i].bytes;
+	}
+	if (total % elt_bytes) {
+		cerr << ins[0].path << ": not whole elements" << endl;
+		return 1;
+	}
+	for (unsigned k=0; k < outs.size(); ++k) {
+		if (!create_output(outs[k], total)) {
+			cerr << outs[k].path << ": cannot create" << endl;
+			return 1;
+		}
+	}
+
+	/* Windows start on page boundaries, for mapping the outputs. */
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t window = window_bytes - window_bytes % (page * elt_bytes);
+	int status = 0;
+	for (size_t begin=0; begin < total && !status; begin += window) {
+		size_t len = min(window, total - begin);
+		advise(ins, begin, window, total);
+
+		vector<const float*> inputs;
+		for (unsigned i=0; i < ins.size(); ++i) {
+			inputs.push_back((const float*)(ins[i].data + begin));
+		}
+		vector<float*> results;
+		for (unsigned k=0; k < outs.size(); ++k) {
+			void* data = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				MAP_SHARED, outs[k].fd, begin);
+			if (data == MAP_FAILED) {
+				cerr << outs[k].path << ": cannot map" << endl;
+				status = 1;
+				break;
+			}
+			results.push_back((float*) data);
+		}
+		if (!status) {
+			machine.run_batch(kernel, inputs, results, len / elt_bytes);
+		}
+
+		/* Written back in the background while the next window
+		 * is computed. */
+		for (unsigned k=0; k < results.size(); ++k) {
+			msync(results[k], len, MS_ASYNC);
+			munmap(results[k], len);
+		}
+	}
+
+	machine.release_kernel(kernel);
+	for (unsigned i=0; i < ins.size(); ++i) {
+		close_column(ins[i]);
+	}
+	for (unsigned k=0; k < outs.size(); ++k) {
+		close_column(outs[k]);
+	}
+	return status;
+}
@@ -0,0 +1,195 @@
+/*
+ * interp.cc
+ *
+ * A tree-walking interpreter, for answers before native code is ready.
+ */
+
+#include "lang.hh"
+
+Interpreter::Interpreter(ASTArena& arena, precision_t precision)
+	: _arena(arena), _precision(precision), _used(0), _len(0),
+	  _frame(NULL)
+{}
+
+Interpreter::~Interpreter() {
+	for (unsigned i=0; i < _buffers.size(); ++i) {
+		delete[] _buffers[i];
+	}
+}
+
+bool Interpreter::prepare(JIT* jit, const vector<ASTNode*>& outs) {
+	DenseMap<ASTNode*, bool> seen;
+	for (unsigned k=0; k < outs.size(); ++k) {
+		if (!prepare(jit, outs[k], seen)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool Interpreter::prepare(JIT* jit, ASTNode* node,
+	DenseMap<ASTNode*, bool>& seen)
+{
+	if (seen.count(node)) {
+		return true;
+	}
+	seen[node] = true;
+
+	/* Unbound names read as zero, as in compiled code. */
+	if (dynamic_cast<ASTVar*>(node)) {
+		return true;
+	}
+	ASTCall* call = dynamic_cast<ASTCall*>(node);
+	if (!call) {
+		return dynamic_cast<ASTNumber*>(node) != NULL;
+	}
+
+	ASTCall::arg_list::iterator it = call->args.begin();
+	for (; it != call->args.end(); ++it) {
+		if (!prepare(jit, *it, seen)) {
+			return false;
+		}
+	}
+	const Builtin* builtin = jit->builtin(call->name, call->args.size());
+	if (builtin) {
+		_builtins[call] = builtin;
+		return builtin->fold != NULL;
+	}
+
+	/* Definitions are parsed again from source, as userFunction does
+	 * for another arithmetic type. */
+	ASTDef* defn = _defs.lookup(call->name);
+	if (!defn) {
+		string source = jit->defs->source(call->name);
+		ASTNode* ast = source.empty() ? NULL
+			: Parser(source, _arena).parse();
+		defn = ast ? dynamic_cast<ASTDef*>(ast) : NULL;
+		if (!defn) {
+			return false;
+		}
+		defn = static_cast<ASTDef*>(_arena.simplify(defn, jit));
+		_defs[call->name] = defn;
+
+		DenseMap<ASTNode*, bool> body_seen;
+		if (!prepare(jit, defn->body, body_seen)) {
+			return false;
+		}
+	}
+	return defn->params.size() == call->args.size();
+}
+
+/* Buffers are handed out afresh for each block. */
+double* Interpreter::buffer() {
+	if (_used == _buffers.size()) {
+		_buffers.push_back(new double[BLOCK]);
+	}
+	return _buffers[_used++];
+}
+
+double Interpreter::round(double num) {
+	return (_precision == PRECISION_F64) ? num : double(float(num));
+}
+
+/* Each node is evaluated once per call, however often it is used. */
+const double* Interpreter::value(ASTNode* node) {
+	DenseMap<ASTNode*, const double*>::iterator it =
+		_frame->values.find(node);
+	if (it != _frame->values.end()) {
+		return it->second;
+	}
+	const double* vals = node->evaluate(*this);
+	_frame->values[node] = vals;
+	return vals;
+}
+
+const double* Interpreter::variable(StringRef ident) {
+	return _frame->vars.lookup(ident);
+}
+
+const double* Interpreter::call(ASTCall* call,
+	const vector<const double*>& args)
+{
+	const Builtin* builtin = _builtins.lookup(call);
+	if (builtin) {
+		double* out = buffer();
+		_args.resize(args.size());
+		for (size_t i=0; i < _len; ++i) {
+			for (unsigned a=0; a < args.size(); ++a) {
+				_args[a] = args[a][i];
+			}
+			out[i] = foldBuiltin(builtin, _args, _precision);
+		}
+		return out;
+	}
+
+	ASTDef* defn = _defs.lookup(call->name);
+	Frame frame;
+	for (unsigned a=0; a < args.size(); ++a) {
+		frame.vars[defn->params[a]] = args[a];
+	}
+	Frame* caller = _frame;
+	_frame = &frame;
+	const double* out = value(defn->body);
+	_frame = caller;
+	return out;
+}
+
+void Interpreter::run(const vector<ASTNode*>& outs,
+	const vector<string>& params, const float** inputs, float** results,
+	size_t n)
+{
+	bool wide = (_precision == PRECISION_F64);
+	for (size_t begin=0; begin < n; begin += BLOCK) {
+		_len = min(size_t(BLOCK), n - begin);
+		_used = 0;
+		Frame frame;
+		_frame = &frame;
+
+		for (unsigned i=0; i < params.size(); ++i) {
+			double* vals = buffer();
+			for (size_t j=0; j < _len; ++j) {
+				vals[j] = wide ? ((const double*) inputs[i])[begin + j]
+					: inputs[i][begin + j];
+			}
+			frame.vars[params[i]] = vals;
+		}
+		for (unsigned k=0; k < outs.size(); ++k) {
+			const double* vals = value(outs[k]);
+			for (size_t j=0; j < _len; ++j) {
+				if (wide) {
+					((double*) results[k])[begin + j] = vals[j];
+				} else {
+					results[k][begin + j] = vals[j];
+				}
+			}
+		}
+		_frame = NULL;
+	}
+}
+
+const double* ASTCall::evaluate(Interpreter& in) {
+	vector<const double*> vals;
+	arg_list::iterator it = args.begin();
+	for (; it != args.end(); ++it) {
+		vals.push_back(in.value(*it));
+	}
+	return in.call(this, vals);
+}
+
+const double* ASTVar::evaluate(Interpreter& in) {
+	const double* vals = in.variable(ident);
+	if (!vals) {
+		ASTNumber zero(0.0);
+		return zero.evaluate(in);
+	}
+	return vals;
+}
+
+const double* ASTNumber::evaluate(Interpreter& in) {
+	double* out = in.buffer();
+	double val = in.round(num);
+	for (size_t i=0; i < in.length(); ++i) {
+		out[i] = val;
+	}
+	return out;
+}
@@ -4,36 +4,384 @@
 
 #pragma once
 
+#include <list>
+#include <map>
 #include <string>
 #include <vector>
+#include <pthread.h>
 
 using namespace std;
 
+namespace llvm {
+	class Function;
+}
+
 struct JIT;
 struct ASTNode;
+struct ASTDef;
+class ASTArena;
+class ThreadPool;
+class DefRegistry;
+struct TieredKernel;
+
+/* How sin, cos, exp, log and pow are computed. */
+enum math_tier_t {
+	MATH_LIBM,	/* libm, one call per lane */
+	MATH_PRECISE,	/* inline polynomials, within 2 ulp; pow by libm */
+	MATH_FAST,	/* inline polynomials, within about 1e-4; pow
+			 * relatively, times |y log|x|| */
+};
+
+/* The element type of kernels' arrays and arithmetic. */
+enum precision_t {
+	PRECISION_F32,	/* float storage and arithmetic */
+	PRECISION_F64,	/* double storage and arithmetic */
+	PRECISION_F16,	/* half storage, float arithmetic */
+};
+
+/* How a reduction kernel combines elements. */
+enum reduce_t {
+	REDUCE_SUM,
+	REDUCE_MIN,
+	REDUCE_MAX,
+	REDUCE_MEAN,
+};
+
+/* Where a kernel finds each element of an array: element i is at
+ * base[i * stride + offset], counted in the kernel's element type, so
+ * one field of interleaved records is read or written in place. The
+ * offset must be less than the stride. */
+struct stream_layout {
+	unsigned stride;
+	unsigned offset;
+
+	stream_layout(unsigned _stride = 1, unsigned _offset = 0)
+		: stride(_stride), offset(_offset)
+	{}
+};
+
+/* (kernel, inputs, results, n) => void, for any streaming kernel.
+ * With no results, the kernel is a reduction, and its value is
+ * stored as a double through results[0]. */
+typedef void (*stream_trampoline)(void*, const float**, float**, size_t);
+
+/* Everything besides the AST that changes the generated code. */
+struct jit_settings {
+	math_tier_t math_tier;
+	bool fast_math;
+	unsigned inline_threshold;
+	precision_t precision;
+	bool quick;		/* skip optimizing, for a first tier */
+	double table_error;	/* zero leaves functions untabulated */
+	map<string, pair<double, double> > ranges;	/* by parameter */
+
+	jit_settings()
+		: math_tier(MATH_LIBM), fast_math(false), inline_threshold(225),
+		  precision(PRECISION_F32), quick(false), table_error(0)
+	{}
+};
 
+/* Compile-time counters, summed over every function compiled. */
+struct jit_stats {
+	double parse_ms;	/* lexing, parsing and simplify() */
+	double codegen_ms;	/* AST to IR */
+	double optimize_ms;	/* the function pass pipeline */
+	double emit_ms;		/* IR to native code */
+	unsigned functions;
+	unsigned ir_before;	/* IR instructions before optimizing */
+	unsigned ir_after;	/* ... and after */
+	size_t code_bytes;	/* machine code emitted */
+
+	jit_stats()
+		: parse_ms(0), codegen_ms(0), optimize_ms(0), emit_ms(0),
+		  functions(0), ir_before(0), ir_after(0), code_bytes(0)
+	{}
+
+	jit_stats& operator+=(const jit_stats& other) {
+		parse_ms += other.parse_ms;
+		codegen_ms += other.codegen_ms;
+		optimize_ms += other.optimize_ms;
+		emit_ms += other.emit_ms;
+		functions += other.functions;
+		ir_before += other.ir_before;
+		ir_after += other.ir_after;
+		code_bytes += other.code_bytes;
+		return *this;
+	}
+};
+
+/* What a machine holds on to, as of one moment. */
+struct jit_memory {
+	unsigned kernels;	/* resident, referenced or not */
+	unsigned referenced;	/* ... of which still referenced */
+	size_t code_bytes;	/* machine code not yet freed */
+	unsigned jits;		/* each with a context, module and engine */
+
+	jit_memory()
+		: kernels(0), referenced(0), code_bytes(0), jits(0)
+	{}
+};
+
+/* Splits source text into its top-level forms. */
+vector<string> split_forms(const string& source);
+
+/* Every method may be called from any number of threads at once.
+ * Each compile borrows a JIT of its own, with its own LLVM context
+ * and module; only emitting machine code is serialized. */
 struct JITMachine {
-	JIT* jit;
+	JIT* jit;		/* the first JIT, and the only one until
+				 * compiles overlap */
+	ThreadPool* pool;
+	pthread_mutex_t lock;	/* guards everything below */
 
-	JITMachine();
+	/* Kernels operate on vectors of 4, 8 or 16 floats. Any other
+	 * value picks the widest the host supports: 8 with AVX, else 4.
+	 * Wider vectors than the host's are split into several. */
+	JITMachine(unsigned lanes = 0);
 	~JITMachine();
 
 	/* For definitions of the type;
-	 * (<4 x float>, ...) => <4 x float> */
+	 * (<N x float>, ...) => <N x float> */
 	void jit_internal(string expr);
 
 	/* For definitions of the type;
-	 * (<4 x float>*, ..., [<4 x float>*]) => void */
+	 * (<N x float>*, ..., [<N x float>*]) => void */
 	void* jit_external(string defn);
 
 	/* For any expression that can be applied over 'params'. */
 	void* jit_external_expr(string expr, vector<string> params);
 
+	/* For definitions of the type;
+	 * (float*, ..., float*, size_t n) => void
+	 * The loop over all n elements runs inside the kernel. */
+	void* jit_external_stream(string defn);
+
+	/* Streaming kernel for any expression over 'params'. */
+	void* jit_external_stream_expr(string expr, vector<string> params);
+
+	/* Fuses several expressions over 'params' into one kernel with
+	 * a result per expression, in order, after the inputs. Inputs are
+	 * loaded once and common subexpressions are computed once. */
+	void* jit_external_exprs(vector<string> exprs, vector<string> params);
+	void* jit_external_stream_exprs(vector<string> exprs,
+		vector<string> params);
+
+	/* A streaming kernel over the parameters of 'defn' whose results
+	 * are its value, then its partial derivative with respect to each
+	 * of 'wrt' (every parameter, if empty), all computed in one pass.
+	 * Calls to definitions are inlined; comparisons and floor have
+	 * zero derivative, min, max, abs, if and select follow the
+	 * operand taken, and hmin and hmax cannot be differentiated. */
+	void* jit_gradient(string defn, vector<string> wrt);
+
+	/* For (sum e), (min e), (max e), (mean e) or (dot a b) over
+	 * 'params', of the type;
+	 * (float*, ..., float*, size_t n) => float
+	 * Lanes accumulate separately, and are combined once at the end. */
+	void* jit_reduce_expr(string expr, vector<string> params);
+
+	/* As jit_external_stream_exprs and jit_reduce_expr, over arrays
+	 * of records: 'layouts' has one entry per parameter, then one per
+	 * result. Narrow records are loaded whole and shuffled apart, wide
+	 * ones gathered; results are stored element by element, leaving
+	 * the other fields alone. run_batch and run_reduce then take each
+	 * array's base pointer, and every array must hold n whole records. */
+	void* jit_strided_exprs(vector<string> exprs, vector<string> params,
+		vector<stream_layout> layouts);
+	void* jit_strided_reduce_expr(string expr, vector<string> params,
+		vector<stream_layout> layouts);
+
+	/* Applies a streaming kernel over n elements using every core.
+	 * Each thread takes cache-sized chunks and steals when idle. */
+	void run_batch(void* kernel, vector<const float*> inputs,
+		float* result, size_t n);
+	void run_batch(void* kernel, vector<const float*> inputs,
+		vector<float*> results, size_t n);
+
+	/* Applies a reduction kernel over n elements using every core.
+	 * Each core's partial result is combined with the others in
+	 * double, whatever the kernel's precision. */
+	double run_reduce(void* kernel, vector<const float*> inputs,
+		size_t n);
+
+	/* As jit_external_stream_exprs, but returns before compiling:
+	 * run_tiered interprets the kernel until native code, compiled
+	 * quickly on a background thread, is swapped in. After enough
+	 * calls it is compiled again with the full pipeline. F16 kernels,
+	 * and those using builtins across lanes such as swizzle, are not
+	 * interpreted, and compile before returning. */
+	TieredKernel* jit_tiered_exprs(vector<string> exprs,
+		vector<string> params);
+
+	/* As run_batch. Calls on one kernel must not overlap. */
+	void run_tiered(TieredKernel* kernel, vector<const float*> inputs,
+		vector<float*> results, size_t n);
+
+	/* Waits for the kernel's compile, if one is running. */
+	void free_tiered(TieredKernel* kernel);
+
+	/* Calls before a tiered kernel is compiled with the full
+	 * pipeline (default 64). Zero keeps the quick code. */
+	void set_tier_up_calls(unsigned calls);
+
 	/* Definitions are internal, all other expressions are external. */
 	void* jit_repl_expr(string expr);
 
+	/* Compiles many forms at once, for libraries of definitions: all
+	 * are generated into one module, definitions are inlined into
+	 * each kernel, and the kernels are emitted together.
+	 * Each definition is registered as by jit_internal and compiled
+	 * as a streaming kernel (a reduction, for bodies such as (sum e))
+	 * under its name; other expressions are compiled as by
+	 * jit_repl_expr, under their source. Forms that fail, later uses
+	 * of a name, and definitions of a name already defined otherwise
+	 * (reported on stderr) are left out. */
+	map<string, void*> compile_batch(vector<string> sources);
+
+	/* compile_batch over every top-level form in the file at 'path'. */
+	map<string, void*> load_file(string path);
+
+	/* Every kernel returned above, including one compiled before,
+	 * carries a reference for the caller. Released kernels stay
+	 * resident, to be returned again, until more than the limit
+	 * (default 1024) are; then the least recently released are
+	 * evicted and their IR and machine code freed. Zero evicts each
+	 * as soon as it is released. Kernels loaded from the cache
+	 * directory are only forgotten, as their libraries stay open. */
+	void retain_kernel(void* kernel);
+	void release_kernel(void* kernel);
+	void set_kernel_limit(unsigned limit);
+
+	jit_memory memory();
+
+	/* Applies to everything compiled afterwards (default MATH_LIBM). */
+	void set_math_tier(math_tier_t tier);
+
+	/* Applies to everything compiled afterwards (default F32). Kernel
+	 * arrays then hold doubles, or halves as uint16_t, passed through
+	 * the float* parameters of run_batch and run_reduce; an F64
+	 * reduction kernel returns a double. Definitions are compiled
+	 * again from their source for each arithmetic type. */
+	void set_precision(precision_t precision);
+
+	/* Lets later kernels ignore NaN, infinity and signed-zero
+	 * semantics: reassociate, divide by reciprocals, and contract
+	 * a * b + c into FMA where the target has it. */
+	void set_fast_math(bool enable);
+
+	/* Calls from kernels to definitions are inlined while the callee
+	 * has fewer than 'threshold' instructions (default 225), and the
+	 * kernel is then optimized again; nothing interprocedural runs
+	 * besides, so other kernels and definitions are left as they
+	 * are. Zero keeps every call. */
+	void set_inline_threshold(unsigned threshold);
+
+	/* Declares that parameters named 'name' in later kernels lie
+	 * within [lo, hi], for set_tabulation. */
+	void set_input_range(string name, double lo, double hi);
+
+	/* Opt-in (default 0, off): in later kernels, subexpressions of a
+	 * single ranged parameter that call sin, cos, exp, log or pow are
+	 * computed at compile time into a table, just fine enough that
+	 * linear interpolation stays within 'max_error' of the exact
+	 * value, and looked up instead. Inputs outside the range are
+	 * clamped to it, and tables over 65536 entries are not built. */
+	void set_tabulation(double max_error);
+
+	jit_stats stats();
+	void reset_stats();
+
+	/* Also keep compiled kernels as shared objects under 'dir', so
+	 * later processes can load them without running LLVM. Storing
+	 * them runs 'cc' to link, on a thread of its own; without it
+	 * kernels are still compiled, just not kept. Kernels are keyed by the host CPU and its
+	 * features, so machines may share a directory. */
+	void set_cache_dir(string dir);
+
+	/* For ahead-of-time builds: compiles each definition in 'defns'
+	 * into a kernel named after it, streaming (a reduction, for
+	 * bodies such as (sum e)) or, if 'vectors', one vector per call
+	 * as jit_external. The kernels and whatever they call are written
+	 * to 'path' as position-independent native code for this host,
+	 * and 'decls' gets the C declaration of each. Later definitions
+	 * may call earlier ones. */
+	bool jit_object(vector<string> defns, string path, bool vectors,
+		vector<string>& decls);
+
 private:
-	void jit_internal_ast(ASTNode* ast);
-	void* jit_external_ast(ASTNode* ast);
-	void* jit_external_expr_ast(ASTNode* ast, vector<string> params);
+	/* The calling conventions of compiled kernels. */
+	enum kernel_t {
+		KERNEL_VECTOR,
+		KERNEL_STREAM,
+		KERNEL_REDUCE,
+	};
+
+	/* What run_batch and run_reduce need to know about a kernel,
+	 * and what evicting it takes. */
+	struct kernel_info {
+		precision_t precision;
+		bool reduces;
+		reduce_t op;
+		vector<unsigned> strides;	/* per input, then result */
+		string key;
+		unsigned refs;
+		list<void*>::iterator released;	/* valid once refs is 0 */
+		JIT* owner;			/* NULL if loaded from the cache */
+		llvm::Function* fn;
+	};
+
+	/* JITs not lent to a compile, and the settings they get. */
+	vector<JIT*> jits;
+	vector<JIT*> idle;
+	jit_settings settings;
+	jit_stats totals;
+	DefRegistry* defs;
+
+	/* Compiled kernels, by canonical AST. */
+	map<string, void*> kernels;
+	string cache_dir;
+	vector<void*> libraries;
+	unsigned cache_links;		/* started, to name their files */
+	unsigned linking;		/* still running */
+	pthread_cond_t linked;
+	map<void*, kernel_info> kernel_infos;
+	list<void*> released;		/* unreferenced, oldest first */
+	unsigned kernel_limit;
+	map<JIT*, vector<llvm::Function*> > doomed;	/* for when lent */
+	map<pair<precision_t, pair<unsigned, unsigned> >, stream_trampoline>
+		trampolines;
+	unsigned tier_up_calls;
+
+	friend class JITLease;
+	JIT* acquire(const jit_settings* config);
+	void release(JIT* borrowed);
+	void evict();
+	void reclaim(JIT* owner);
+	stream_trampoline trampoline(unsigned nins, unsigned nouts,
+		precision_t precision);
+
+	ASTNode* parse(JIT* jit, string expr, ASTArena& arena);
+	ASTNode* parse(JIT* jit, vector<string> exprs, ASTArena& arena);
+	string ast_key(ASTDef* defn);
+	void* cache_load(const string& key);
+	void cache_store(JIT* jit, const string& key, llvm::Function* fn);
+	static void* cache_linker(void* arg);
+
+	bool jit_internal_ast(JIT* jit, ASTNode* ast, const string& source);
+	llvm::Function* foreign_codegen(JIT* jit, ASTDef* defn, kernel_t kind,
+		const vector<stream_layout>& layouts);
+	string kernel_key(JIT* jit, ASTDef* defn, kernel_t kind,
+		const vector<stream_layout>& layouts);
+	void* find_kernel(const string& key);
+	void* add_kernel(JIT* jit, const string& key, void* func,
+		llvm::Function* fn, ASTDef* defn, kernel_t kind,
+		const vector<stream_layout>& layouts);
+	void* jit_foreign(JIT* jit, ASTDef* defn, kernel_t kind,
+		const vector<stream_layout>& layouts);
+	void* jit_external_ast(JIT* jit, ASTNode* ast, kernel_t kind);
+	void start_tier(TieredKernel* kernel, unsigned tier);
+	static void* tier_compiler(void* arg);
+	void* jit_external_expr_ast(JIT* jit, ASTNode* ast,
+		vector<string> params, kernel_t kind,
+		const vector<stream_layout>& layouts = vector<stream_layout>());
 };
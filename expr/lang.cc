@@ -4,16 +4,21 @@
 
 #include "lang.hh"
 
+static double now_ms() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1e3 + tv.tv_usec * 1e-3;
+}
+
 static bool isIdent(char c) {
 	return (c > ' ') && (c != '(') && (c != ')');
 }
 
 token_t Lexer::getToken() {
-	/* Empty the queue before scanning forward. */
-	if (_tok_q.size()) {
-		token_t tok = _tok_q.front();
-		_tok_q.pop_front();
-		return tok;
+	/* Hand back a token that was put back before scanning. */
+	if (_has_pushed) {
+		_has_pushed = false;
+		return _pushed;
 	}
 
 	for (; _pos < _buf.size(); ++_pos) {
@@ -25,88 +30,195 @@ token_t Lexer::getToken() {
 			++_pos;
 			return TOK_CLOSE;
 		} else if (cur > ' ') {
-			/* Store the last identifier. */
-			_lastToken = "";
-			_lastToken += cur;
+			/* Remember where the last identifier lies. */
+			size_t start = _pos;
 			for (_pos=_pos+1;
 				_pos < _buf.size()
 				&& isIdent(_buf[_pos]);
 				++_pos)
-			{
-				_lastToken += _buf[_pos];
-			}
+			{}
+			_lastToken = _buf.slice(start, _pos);
 			return TOK_IDENT;
 		}
 	}
 	return TOK_END;
 }
 
-string Lexer::getTokenString() {
+StringRef Lexer::getTokenString() {
 	return _lastToken;
 }
 
 void Lexer::putToken(token_t tok) {
-	_tok_q.push_back(tok);
+	_pushed = tok;
+	_has_pushed = true;
+}
+
+ASTArena::~ASTArena() {
+	/* The allocator frees the memory, but not what nodes own. */
+	for (size_t i=_nodes.size(); i > 0; --i) {
+		_nodes[i - 1]->~ASTNode();
+	}
+}
+
+void* ASTArena::allocate(size_t size) {
+	void* mem = _alloc.Allocate(size, AlignOf<uint64_t>::Alignment);
+	_nodes.push_back(static_cast<ASTNode*>(mem));
+	return mem;
+}
+
+StringRef ASTArena::intern(StringRef ident) {
+	return _idents.GetOrCreateValue(ident).getKey();
+}
+
+ASTNode* ASTArena::simplify(ASTNode* node, JIT* jit) {
+	DenseMap<ASTNode*, ASTNode*>::iterator it = _simple.find(node);
+	if (it != _simple.end()) {
+		return it->second;
+	}
+	ASTNode* simple = node->simplify(jit, *this);
+	_simple[node] = simple;
+	return simple;
 }
 
-Parser::Parser(string expr)
-	: _lex(Lexer(expr))
+Parser::Parser(StringRef expr, ASTArena& arena)
+	: _lex(expr), _arena(arena)
 {}
 
+/* Parses another expression into the same DAG. */
+void Parser::restart(StringRef expr) {
+	_lex = Lexer(expr);
+}
+
+bool Parser::atEnd() {
+	return _lex.getToken() == TOK_END;
+}
+
+template <typename T>
+static void appendBytes(SmallVectorImpl<char>& key, const T& val) {
+	const char* bytes = reinterpret_cast<const char*>(&val);
+	key.append(bytes, bytes + sizeof(T));
+}
+
+/* Returns the first node parsed with the same key, so that identical
+ * subtrees become one node. Children are shared before their parents,
+ * so a node's key only needs its children's addresses. */
+ASTNode* Parser::share(StringRef key, ASTNode* node) {
+	ASTNode*& slot = _shared[key];
+	if (!slot) {
+		slot = node;
+	}
+	return slot;
+}
+
+ASTNode* Parser::shareVar(StringRef ident) {
+	/* Innermost let binding first. */
+	for (size_t i=_bindings.size(); i > 0; --i) {
+		if (_bindings[i - 1].first == ident) {
+			return _bindings[i - 1].second;
+		}
+	}
+
+	StringRef name = _arena.intern(ident);
+	SmallString<16> key("v");
+	appendBytes(key, name.data());
+	return share(key, new (_arena) ASTVar(name));
+}
+
 ASTNode* Parser::parse() {
 	token_t cur = _lex.getToken();
 	if (cur == TOK_END) {
 		return NULL;
 	} else if (cur == TOK_IDENT) {
-		/* This parser doesn't handle 0's. */
-		float num = atof(_lex.getTokenString().c_str());
-		if (num == 0.0) {
-			return new ASTVar(_lex.getTokenString());
-		} else {
-			return new ASTNumber(num);
+		/* Numbers must parse in full; anything else is a variable. */
+		StringRef tok = _lex.getTokenString();
+		char first = (tok.size() > 1 && (tok[0] == '-' || tok[0] == '+'))
+			? tok[1] : tok[0];
+		if (!isdigit(first) && first != '.') {
+			return shareVar(tok);
+		}
+		SmallString<32> text(tok);
+		char* end;
+		double num = strtod(text.c_str(), &end);
+		if (*end != '\0') {
+			return shareVar(tok);
 		}
+		SmallString<16> key("n");
+		appendBytes(key, num);
+		return share(key, new (_arena) ASTNumber(num));
 	} else if (cur == TOK_OPEN && _lex.getToken() == TOK_IDENT) {
 		token_t probe;
-		string cur_ident = _lex.getTokenString();
+		StringRef cur_ident = _lex.getTokenString();
 		if (cur_ident == "def") {
 			/* (def <name> (...) <body>) */
 			probe = _lex.getToken();
 			if (probe != TOK_IDENT) return NULL;
-			string def_name = _lex.getTokenString();
+			string def_name = _lex.getTokenString().str();
+			if (def_name.find('.') != string::npos) {
+				return NULL;
+			}
 			probe = _lex.getToken();
 			if (probe != TOK_OPEN) return NULL;
-			ASTDef* defn = new ASTDef(def_name);
+			ASTDef* defn = new (_arena) ASTDef(def_name);
 
 			while ((probe = _lex.getToken()) && probe == TOK_IDENT)
 			{
-				string var = _lex.getTokenString();
+				StringRef var = _lex.getTokenString();
 				if (!isalpha(var[0])) {
-					delete defn;
 					return NULL;
 				}
-				defn->params.push_back(var);
+				defn->params.push_back(var.str());
 			}
 
 			if (probe != TOK_CLOSE) {
-				delete defn;
 				return NULL;
 			}
 			defn->body = parse();
 			if (!defn->body || _lex.getToken() != TOK_CLOSE) {
-				delete defn;
 				return NULL;
 			}
 
 			return defn;
+		} else if (cur_ident == "let") {
+			/* (let ((<name> <expr>) ...) <body>), where each binding
+			 * can use the ones before it. */
+			if (_lex.getToken() != TOK_OPEN) return NULL;
+			size_t outer = _bindings.size();
+			while ((probe = _lex.getToken()) && probe == TOK_OPEN) {
+				if (_lex.getToken() != TOK_IDENT) return NULL;
+				StringRef var = _lex.getTokenString();
+				if (!isalpha(var[0])) return NULL;
+				ASTNode* val = parse();
+				if (!val || _lex.getToken() != TOK_CLOSE) return NULL;
+				_bindings.push_back(make_pair(var, val));
+			}
+			if (probe != TOK_CLOSE) return NULL;
+
+			ASTNode* body = parse();
+			_bindings.resize(outer);
+			if (!body || _lex.getToken() != TOK_CLOSE) return NULL;
+			return body;
 		} else {
-			/* (<ident> ...) */
-			ASTCall* fcall = new ASTCall(cur_ident);
+			/* (<ident> ...); dotted names are the compiler's own,
+			 * such as pow.int and definitions' mangled names. */
+			if (cur_ident.find('.') != StringRef::npos) {
+				return NULL;
+			}
+			ASTCall* fcall = new (_arena) ASTCall(
+				_arena.intern(cur_ident));
 			while ((probe = _lex.getToken()) && probe != TOK_CLOSE)
 			{
 				_lex.putToken(probe);
-				fcall->args.push_back(parse());
+				ASTNode* arg = parse();
+				if (!arg) return NULL;
+				fcall->args.push_back(arg);
 			}
-			return fcall;
+
+			SmallString<64> key("c");
+			appendBytes(key, fcall->name.data());
+			for (unsigned i=0; i < fcall->args.size(); ++i) {
+				appendBytes(key, fcall->args[i]);
+			}
+			return share(key, fcall);
 		}
 	}
 	return NULL;
@@ -128,47 +240,130 @@ Value* ASTDef::codeGen(JIT* jit) {
 	if (!validateArgs()) {
 		return NULL;
 	}
+	double start = now_ms();
 
-	/* (Vec4<float>, ...) => Vec4<float> */
+	/* (Vec4<float>, ...) => Vec4<float>; for a kernel's tail, the
+	 * mask of lanes in range comes last. */
+	bool masked = (jit->lane_mask != NULL);
 	vector<Type*> proto(params.size(), jit->float_vec_const);
+	if (masked) {
+		proto.push_back(jit->lane_mask->getType());
+	}
 	FunctionType* ftype = FunctionType::get(jit->float_vec_const,
 		ArrayRef<Type*>(proto), false);
-	Function* fn = Function::Create(ftype,
-		Function::ExternalLinkage, name, jit->mod);
+	Function* fn = Function::Create(ftype, Function::ExternalLinkage,
+		jit->defName(name) + (masked ? ".tail" : ""), jit->mod);
+
+	/* Definitions are pure, which lets calls to them be CSE'd. */
+	fn->setDoesNotAccessMemory();
+	fn->setDoesNotThrow();
 
-	/* Fill up the global symbol table. */
+	/* Only the parameters are in scope. */
 	BasicBlock* blk = BasicBlock::Create(jit->mod->getContext(),
 		name, fn);
-	jit->builder = new IRBuilder<>(blk);
+	jit->builder->SetInsertPoint(blk);
+	jit->symbols.clear();
 	Function::arg_iterator param = fn->arg_begin();
 	for (unsigned i=0; i < params.size(); ++i, ++param) {
 		string argname = params[i];
 		jit->symbols[argname] = param;
 	}
+	if (masked) {
+		jit->lane_mask = param;
+	}
 
-	Value* child_node = body->codeGen(jit);
-	if (!child_node) return NULL;
+	/* Bodies only foreign kernels can compute, such as reductions,
+	 * leave nothing behind. */
+	bool outer_crossed = jit->crossed;
+	jit->crossed = false;
+	Value* child_node = jit->generateBody(body);
+	if (jit->crossed) {
+		jit->crossing.insert(jit->defName(name));
+	}
+	jit->crossed = outer_crossed;
+	if (!child_node) {
+		fn->eraseFromParent();
+		return NULL;
+	}
 	jit->builder->CreateRet(child_node);
-	verifyFunction(*fn);
-	jit->optimizer->run(*fn);
+	jit->finish(fn, start);
 	return fn;
 }
 
+void ASTDef::canonical(ASTKey& key) {
+	vector<string> outer = key.params;
+	key.params = params;
+	key.text += "(def " + utostr(params.size()) + " ";
+	body->canonical(key);
+	key.text += ")";
+	key.params = outer;
+}
+
+/* Lets LLVM reassociate and contract when fast math is on. */
+static Value* relaxed(JIT* jit, Value* val) {
+	Instruction* inst = dyn_cast<Instruction>(val);
+	if (jit->fast_math && inst) {
+		inst->setHasUnsafeAlgebra(true);
+	}
+	return val;
+}
+
+/* Kernels are named apart from definitions, which calls look up by
+ * name in the same module. */
 ASTForeignDef::ASTForeignDef(ASTDef* def)
-	: ASTDef(def->name)
+	: ASTDef("kernel." + def->name)
 {
 	params = def->params;
 	body = def->body;
 }
 
+/* A tuple body produces one result per element. */
+vector<ASTNode*> ASTForeignDef::outputs() {
+	ASTTuple* tuple = dynamic_cast<ASTTuple*>(body);
+	if (tuple) {
+		return vector<ASTNode*>(tuple->elts.begin(), tuple->elts.end());
+	}
+	return vector<ASTNode*>(1, body);
+}
+
+/* Pads the layouts out to every stream, and checks them. */
+bool ASTForeignDef::validateLayouts(unsigned nouts) {
+	if (layouts.size() > params.size() + nouts) {
+		return false;
+	}
+	layouts.resize(params.size() + nouts);
+	for (unsigned i=0; i < layouts.size(); ++i) {
+		if (!layouts[i].stride || layouts[i].offset >= layouts[i].stride) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Generates every output in one scope, so they share common code. */
+static bool generateOutputs(JIT* jit, const vector<ASTNode*>& outs,
+	vector<Value*>& vals)
+{
+	jit->emitted.clear();
+	vals.clear();
+	for (unsigned k=0; k < outs.size(); ++k) {
+		Value* val = jit->generate(outs[k]);
+		if (!val) return false;
+		vals.push_back(val);
+	}
+	return true;
+}
+
 Value* ASTForeignDef::codeGen(JIT* jit) {
 	if (!validateArgs()) {
 		return NULL;
 	}
+	double start = now_ms();
+	vector<ASTNode*> outs = outputs();
 
-	/* (float*, ..., i8*) => void */
+	/* (float*, ..., i8*, ...) => void */
 	vector<Type*> proto(params.size(), jit->float_ptr);
-	proto.push_back(jit->result_type);
+	proto.insert(proto.end(), outs.size(), jit->result_type);
 	FunctionType* ftype = FunctionType::get(jit->void_ret,
 		ArrayRef<Type*>(proto), false);
 	Function* fn = Function::Create(ftype,
@@ -176,278 +371,3140 @@ Value* ASTForeignDef::codeGen(JIT* jit) {
 
 	BasicBlock* blk = BasicBlock::Create(jit->mod->getContext(),
 		name, fn);
-	jit->builder = new IRBuilder<>(blk);
+	jit->builder->SetInsertPoint(blk);
+	jit->symbols.clear();
 
-	/* Create vectors out of the function arguments. */ 
+	/* Create vectors out of the function arguments. The caller only
+	 * guarantees element alignment, whatever the vector width. */ 
 	Function::arg_iterator param = fn->arg_begin();
 	for (unsigned i=0; i < params.size(); ++i, ++param) {
 		string argname = params[i];
 		Value* argptr = param;
 		Value* argvec = jit->builder->CreateBitCast(argptr,
 			jit->float_vec, "");
-		argptr = jit->builder->CreateLoad(argvec, 
-			false, argname);
-		jit->symbols[argname] = argptr;
+		argptr = jit->builder->CreateAlignedLoad(argvec, 
+			jit->store_bytes, argname);
+		jit->symbols[argname] = jit->widen(argptr);
 	}
 
-	/* Inject the result vector into the i8 address provided. */
-	Value* child_node = body->codeGen(jit);
-	if (!child_node) return NULL;
-	Value* result_float = param;
-	jit->builder->CreateCall2(jit->storeu,
-		result_float, child_node, "");
+	/* Inject each result vector into the i8 address provided. */
+	vector<Value*> vals;
+	if (!generateOutputs(jit, outs, vals)) {
+		fn->eraseFromParent();
+		return NULL;
+	}
+	for (unsigned k=0; k < vals.size(); ++k, ++param) {
+		Value* result_float = param;
+		jit->builder->CreateAlignedStore(jit->narrow(vals[k]),
+			jit->builder->CreateBitCast(result_float, jit->float_vec, ""),
+			jit->store_bytes);
+	}
 	jit->builder->CreateRetVoid();
-	verifyFunction(*fn);
-	jit->optimizer->run(*fn);
+	jit->finish(fn, start);
 	return fn;
 
 }
 
-ASTCall::~ASTCall() {
-	list<ASTNode*>::iterator it = args.begin();
-	for (; it != args.end(); ++it) {
-		if (*it) {
-			delete *it;
+/* Records up to this many elements per vector are loaded whole. */
+static const unsigned max_shuffle_elts = 64;
+
+/* The address of element 'pos' of an array laid out as 'layout'. */
+static Value* elementPtr(JIT* jit, Value* base, Value* pos,
+	const stream_layout& layout)
+{
+	if (layout.stride == 1) {
+		return jit->builder->CreateInBoundsGEP(base, pos);
+	}
+	Value* at = jit->builder->CreateMul(pos,
+		ConstantInt::get(jit->size_type, layout.stride));
+	at = jit->builder->CreateAdd(at,
+		ConstantInt::get(jit->size_type, layout.offset));
+	return jit->builder->CreateInBoundsGEP(base, at);
+}
+
+/* Loads elements idx, ..., idx + lanes - 1. Narrow records are read
+ * whole, lanes at a time, and the field shuffled out of them; reading
+ * from the start of the first record never strays past the last. */
+static Value* loadStrided(JIT* jit, Value* base, Value* idx,
+	const stream_layout& layout, const string& name)
+{
+	IRBuilder<>* builder = jit->builder;
+	if (layout.stride == 1) {
+		Value* argvec = builder->CreateBitCast(
+			builder->CreateInBoundsGEP(base, idx), jit->float_vec, "");
+		return builder->CreateAlignedLoad(argvec, jit->store_bytes, name);
+	}
+
+	Type* lane_type = Type::getInt32Ty(jit->mod->getContext());
+	Type* store_pod = cast<VectorType>(
+		jit->store_vec_const)->getElementType();
+	Value* first = builder->CreateInBoundsGEP(base, builder->CreateMul(idx,
+		ConstantInt::get(jit->size_type, layout.stride)));
+	unsigned span = jit->lanes * layout.stride;
+	if (span <= max_shuffle_elts) {
+		VectorType* records = VectorType::get(store_pod, span);
+		Value* whole = builder->CreateAlignedLoad(builder->CreateBitCast(
+			first, PointerType::get(records, 0)), jit->store_bytes);
+		vector<Constant*> field;
+		for (unsigned j=0; j < jit->lanes; ++j) {
+			field.push_back(ConstantInt::get(lane_type,
+				j * layout.stride + layout.offset));
 		}
+		return builder->CreateShuffleVector(whole,
+			UndefValue::get(records),
+			ConstantVector::get(ArrayRef<Constant*>(field)), name);
+	}
+
+	/* Wide records: one load per lane. */
+	Value* argvec = UndefValue::get(jit->store_vec_const);
+	for (unsigned j=0; j < jit->lanes; ++j) {
+		Value* elt = builder->CreateLoad(builder->CreateInBoundsGEP(first,
+			ConstantInt::get(jit->size_type,
+				j * layout.stride + layout.offset)));
+		argvec = builder->CreateInsertElement(argvec, elt,
+			ConstantInt::get(lane_type, j));
 	}
+	return argvec;
 }
 
-Value* ASTCall::codeGen(JIT* jit) {
-	/* Generate code for all child nodes. */
-	vector<Value*> vals;
-	list<ASTNode*>::iterator it = args.begin();
-	for (; it != args.end(); ++it) {
-		Value* code = (*it)->codeGen(jit);
-		if (!code) return NULL;
-		vals.push_back(code);
+/* Stores a vector to elements idx, ..., idx + lanes - 1; strided
+ * ones one at a time, so the rest of each record is untouched. */
+static void storeStrided(JIT* jit, Value* base, Value* idx,
+	const stream_layout& layout, Value* stored)
+{
+	IRBuilder<>* builder = jit->builder;
+	if (layout.stride == 1) {
+		builder->CreateAlignedStore(stored, builder->CreateBitCast(
+			builder->CreateInBoundsGEP(base, idx), jit->float_vec, ""),
+			jit->store_bytes);
+		return;
 	}
 
-	Value* ret = NULL;
+	Type* lane_type = Type::getInt32Ty(jit->mod->getContext());
+	for (unsigned j=0; j < jit->lanes; ++j) {
+		Value* pos = builder->CreateAdd(idx,
+			ConstantInt::get(jit->size_type, j));
+		builder->CreateStore(
+			builder->CreateExtractElement(stored,
+				ConstantInt::get(lane_type, j)),
+			elementPtr(jit, base, pos, layout));
+	}
+}
 
-	/* Handle arithmetic. */
-	#define FUNC(_name, _llvmop) \
-		if (name == _name) { \
-			ret = jit->builder->Create ## _llvmop ( \
-				vals[0], vals[1], ""); \
-			for (unsigned i=2; i < args.size(); ++i) { \
-				ret = jit->builder->Create ## _llvmop ( \
-					ret, vals[i]); \
-			} \
-			return ret; \
-		} \
+/* Binds each parameter to the vector at 'idx' of its input. */
+static void loadVectors(JIT* jit, const vector<string>& params,
+	const vector<Value*>& inputs, const vector<stream_layout>& layouts,
+	Value* idx)
+{
+	for (unsigned i=0; i < params.size(); ++i) {
+		jit->symbols[params[i]] = jit->widen(loadStrided(jit, inputs[i],
+			idx, layouts[i], params[i]));
+	}
+}
 
-	if (args.size() >= 2) {
-		FUNC("+", FAdd);
-		FUNC("-", FSub);
-		FUNC("*", FMul);
-		FUNC("/", FDiv);
+/* Lanes past the end are redirected to element 'rest', which is
+ * always in range: they reload it, and their results are dropped. */
+static void tailLanes(JIT* jit, Value* rest, Value* count,
+	vector<Value*>& valid, vector<Value*>& pos)
+{
+	for (unsigned j=0; j < jit->lanes; ++j) {
+		Value* at = jit->builder->CreateAdd(rest,
+			ConstantInt::get(jit->size_type, j));
+		valid.push_back(jit->builder->CreateICmpULT(at, count));
+		pos.push_back(jit->builder->CreateSelect(valid[j], at, rest));
 	}
+}
 
-	#undef FUNC
+/* The lanes 'valid' marks, as a vector. */
+static Value* laneMask(JIT* jit, const vector<Value*>& valid) {
+	Type* lane_type = Type::getInt32Ty(jit->mod->getContext());
+	Value* mask = UndefValue::get(VectorType::get(
+		Type::getInt1Ty(jit->mod->getContext()), jit->lanes));
+	for (unsigned j=0; j < jit->lanes; ++j) {
+		mask = jit->builder->CreateInsertElement(mask, valid[j],
+			ConstantInt::get(lane_type, j));
+	}
+	return mask;
+}
 
-	/* Handle more advanced vector intrinsics. */
-	#define SPECIAL_FUNC(_name, _jvar) \
-	if (name == _name) { \
-		return jit->builder->CreateCall(_jvar, \
-			vals[0], ""); \
-	} \
+/* Binds each parameter to a vector gathered from 'pos'. */
+static void loadLanes(JIT* jit, const vector<string>& params,
+	const vector<Value*>& inputs, const vector<stream_layout>& layouts,
+	const vector<Value*>& pos)
+{
+	Type* lane_type = Type::getInt32Ty(jit->mod->getContext());
+	for (unsigned i=0; i < params.size(); ++i) {
+		Value* argvec = UndefValue::get(jit->store_vec_const);
+		for (unsigned j=0; j < jit->lanes; ++j) {
+			Value* elt = jit->builder->CreateLoad(
+				elementPtr(jit, inputs[i], pos[j], layouts[i]));
+			argvec = jit->builder->CreateInsertElement(argvec, elt,
+				ConstantInt::get(lane_type, j));
+		}
+		jit->symbols[params[i]] = jit->widen(argvec);
+	}
+}
 
-	if (args.size() == 1) {
-		SPECIAL_FUNC("sqrt", jit->vsqrt);
-		SPECIAL_FUNC("sin", jit->vsin);
-		SPECIAL_FUNC("cos", jit->vcos);
-		SPECIAL_FUNC("exp", jit->vexp);
-		SPECIAL_FUNC("log", jit->vlog);
+Value* ASTStreamDef::codeGen(JIT* jit) {
+	vector<ASTNode*> outs = outputs();
+	if (!validateArgs() || !validateLayouts(outs.size())) {
+		return NULL;
 	}
+	double start = now_ms();
+
+	/* (float*, ..., float* result, ..., size_t) => void */
+	vector<Type*> proto(params.size() + outs.size(), jit->float_ptr);
+	proto.push_back(jit->size_type);
+	FunctionType* ftype = FunctionType::get(jit->void_ret,
+		ArrayRef<Type*>(proto), false);
+	Function* fn = Function::Create(ftype,
+		Function::ExternalLinkage, name, jit->mod);
 
-	#undef SPECIAL_FUNC
+	LLVMContext& ctx = jit->mod->getContext();
+	BasicBlock* entry = BasicBlock::Create(ctx, name, fn);
+	BasicBlock* loop = BasicBlock::Create(ctx, "loop", fn);
+	BasicBlock* check = BasicBlock::Create(ctx, "check", fn);
+	BasicBlock* tail = BasicBlock::Create(ctx, "tail", fn);
+	BasicBlock* exit = BasicBlock::Create(ctx, "exit", fn);
+	jit->builder->SetInsertPoint(entry);
+	jit->symbols.clear();
 
-	if (name == "pow" && args.size() == 2) {
-		return jit->builder->CreateCall2(jit->vpow,
-			vals[0], vals[1], "");
+	vector<Value*> inputs, results;
+	Function::arg_iterator param = fn->arg_begin();
+	for (unsigned i=0; i < params.size(); ++i, ++param) {
+		inputs.push_back(param);
+	}
+	for (unsigned k=0; k < outs.size(); ++k, ++param) {
+		results.push_back(param);
 	}
+	Value* count = param;
 
-	Function* fn = jit->mod->getFunction(name);
-	if (!fn || fn->arg_size() != vals.size()) {
+	unsigned lanes = jit->lanes;
+	Value* zero = ConstantInt::get(jit->size_type, 0);
+	Value* step = ConstantInt::get(jit->size_type, lanes);
+
+	/* Round n down to a whole number of vectors. */
+	Value* bulk = jit->builder->CreateAnd(count,
+		ConstantInt::get(jit->size_type, ~uint64_t(lanes - 1)));
+	jit->builder->CreateCondBr(jit->builder->CreateICmpNE(bulk, zero),
+		loop, check);
+
+	/* Main loop: one vector load per input, one store per result. */
+	jit->builder->SetInsertPoint(loop);
+	PHINode* idx = jit->builder->CreatePHI(jit->size_type, 2, "i");
+	idx->addIncoming(zero, entry);
+	loadVectors(jit, params, inputs, layouts, idx);
+
+	vector<Value*> vals;
+	if (!generateOutputs(jit, outs, vals)) {
+		fn->eraseFromParent();
+		return NULL;
+	}
+	for (unsigned k=0; k < vals.size(); ++k) {
+		storeStrided(jit, results[k], idx, layouts[params.size() + k],
+			jit->narrow(vals[k]));
+	}
+	Value* next = jit->builder->CreateAdd(idx, step);
+	BasicBlock* loop_end = jit->builder->GetInsertBlock();
+	idx->addIncoming(next, loop_end);
+	jit->builder->CreateCondBr(jit->builder->CreateICmpULT(next, bulk),
+		loop, check);
+
+	/* Pick up the n % lanes elements left over, if any. */
+	jit->builder->SetInsertPoint(check);
+	PHINode* rest = jit->builder->CreatePHI(jit->size_type, 2, "rest");
+	rest->addIncoming(zero, entry);
+	rest->addIncoming(next, loop_end);
+	jit->builder->CreateCondBr(jit->builder->CreateICmpULT(rest, count),
+		tail, exit);
+
+	/* Lanes past the end store lane 0 back over element 'rest'. */
+	jit->builder->SetInsertPoint(tail);
+	Type* lane_type = Type::getInt32Ty(ctx);
+	vector<Value*> valid, pos;
+	tailLanes(jit, rest, count, valid, pos);
+	loadLanes(jit, params, inputs, layouts, pos);
+
+	jit->lane_mask = laneMask(jit, valid);
+	bool generated = generateOutputs(jit, outs, vals);
+	jit->lane_mask = NULL;
+	if (!generated) {
+		fn->eraseFromParent();
 		return NULL;
-	} else {
-		return jit->builder->CreateCall(fn,
-			ArrayRef<Value*>(vals), "");
 	}
+	for (unsigned k=0; k < vals.size(); ++k) {
+		Value* stored = jit->narrow(vals[k]);
+		Value* first = jit->builder->CreateExtractElement(stored,
+			ConstantInt::get(lane_type, 0));
+		for (unsigned j=0; j < lanes; ++j) {
+			Value* elt = jit->builder->CreateExtractElement(stored,
+				ConstantInt::get(lane_type, j));
+			elt = jit->builder->CreateSelect(valid[j], elt, first);
+			jit->builder->CreateStore(elt, elementPtr(jit, results[k],
+				pos[j], layouts[params.size() + k]));
+		}
+	}
+	jit->builder->CreateBr(exit);
+
+	jit->builder->SetInsertPoint(exit);
+	jit->builder->CreateRetVoid();
+	jit->finish(fn, start);
+	return fn;
 }
 
-Value* ASTVar::codeGen(JIT* jit) {
-	Value* val = jit->symbols[ident];
-	if (!val) {
-		ASTNumber zero(0.0);
-		return zero.codeGen(jit);
+/* Recognizes (sum e), (min e), (max e), (mean e) and (dot a b). */
+bool reduceOp(ASTNode* body, reduce_t& op) {
+	ASTCall* call = dynamic_cast<ASTCall*>(body);
+	if (!call) {
+		return false;
+	} else if (call->args.size() == 2) {
+		op = REDUCE_SUM;
+		return call->name == "dot";
+	} else if (call->args.size() != 1) {
+		return false;
 	}
-	return val;
+
+	if (call->name == "sum") op = REDUCE_SUM;
+	else if (call->name == "min") op = REDUCE_MIN;
+	else if (call->name == "max") op = REDUCE_MAX;
+	else if (call->name == "mean") op = REDUCE_MEAN;
+	else return false;
+	return true;
 }
 
-Value* ASTNumber::codeGen(JIT* jit) {
-	ConstantFP* val = ConstantFP::get(jit->mod->getContext(),
-		APFloat(num));
-	vector<Constant*> vec(4, val);
-	return ConstantVector::get(ArrayRef<Constant*>(vec));
+/* The value that leaves any element unchanged under 'op'. */
+static Value* reduceIdentity(JIT* jit, reduce_t op) {
+	double ident = 0.0;
+	if (op == REDUCE_MIN) {
+		ident = HUGE_VAL;
+	} else if (op == REDUCE_MAX) {
+		ident = -HUGE_VAL;
+	}
+	return ASTNumber(ident).codeGen(jit);
 }
 
-JIT::JIT() {
-	InitializeNativeTarget();
-	LLVMContext& ctx = getGlobalContext();
-	mod = new Module("jit", ctx);
+/* NaN elements are skipped by min and max, as with fminf. */
+static Value* reduceCombine(JIT* jit, reduce_t op, Value* acc, Value* val) {
+	if (op == REDUCE_MIN) {
+		return jit->builder->CreateSelect(
+			jit->builder->CreateFCmpOLT(val, acc), val, acc);
+	} else if (op == REDUCE_MAX) {
+		return jit->builder->CreateSelect(
+			jit->builder->CreateFCmpOGT(val, acc), val, acc);
+	}
+	return relaxed(jit, jit->builder->CreateFAdd(acc, val));
+}
 
-	string errs;
-	jit = EngineBuilder(mod).setErrorStr(&errs).create();
-	if (!jit) {
-		cerr << errs.c_str() << endl;
+ASTReduceDef::ASTReduceDef(ASTDef* def)
+	: ASTForeignDef(def), op(REDUCE_SUM)
+{
+	reduceOp(body, op);
+}
+
+/* The element to accumulate: the operand, or for dot the product. */
+Value* ASTReduceDef::element(JIT* jit) {
+	ASTCall* call = static_cast<ASTCall*>(body);
+	vector<ASTNode*> outs(call->args.begin(), call->args.end());
+	vector<Value*> vals;
+	if (!generateOutputs(jit, outs, vals)) {
+		return NULL;
+	}
+	if (vals.size() == 2) {
+		return relaxed(jit, jit->builder->CreateFMul(vals[0], vals[1]));
 	}
+	return vals[0];
+}
 
-	float_pod = Type::getFloatTy(mod->getContext());
-	float_ptr = PointerType::get(float_pod, 0);
-	float_vec_const  = VectorType::get(float_pod, 4);
-	float_vec = PointerType::get(float_vec_const, 0);
-	void_ret = Type::getVoidTy(mod->getContext());
-	result_type = PointerType::get(
-		IntegerType::get(mod->getContext(), 8), 0);
+Value* ASTReduceDef::codeGen(JIT* jit) {
+	if (!validateArgs() || !reduceOp(body, op) || !validateLayouts(0)) {
+		return NULL;
+	}
+	double start = now_ms();
+
+	/* (float*, ..., size_t) => float */
+	vector<Type*> proto(params.size(), jit->float_ptr);
+	proto.push_back(jit->size_type);
+	FunctionType* ftype = FunctionType::get(jit->float_pod,
+		ArrayRef<Type*>(proto), false);
+	Function* fn = Function::Create(ftype,
+		Function::ExternalLinkage, name, jit->mod);
+
+	LLVMContext& ctx = jit->mod->getContext();
+	BasicBlock* entry = BasicBlock::Create(ctx, name, fn);
+	BasicBlock* loop = BasicBlock::Create(ctx, "loop", fn);
+	BasicBlock* check = BasicBlock::Create(ctx, "check", fn);
+	BasicBlock* tail = BasicBlock::Create(ctx, "tail", fn);
+	BasicBlock* exit = BasicBlock::Create(ctx, "exit", fn);
+	jit->builder->SetInsertPoint(entry);
+	jit->symbols.clear();
 
-	storeu = mod->getFunction("llvm.x86.sse.storeu.ps");
-	if (!storeu) {
-		PointerType* PointerTy_6 = PointerType::get(
-			IntegerType::get(mod->getContext(), 8), 0);
-		std::vector<Type*>FuncTy_8_args;
-		FuncTy_8_args.push_back(PointerTy_6);
-		FuncTy_8_args.push_back(float_vec_const);
-		FunctionType* FuncTy_8 = FunctionType::get(
-			/*Result=*/Type::getVoidTy(mod->getContext()),
-			/*Params=*/FuncTy_8_args,
-			/*isVarArg=*/false);
-		storeu = Function::Create(
-			/*Type=*/FuncTy_8,
-			/*Linkage=*/GlobalValue::ExternalLinkage,
-			/*Name=*/"llvm.x86.sse.storeu.ps", mod); 
-		storeu->setCallingConv(CallingConv::C);
+	vector<Value*> inputs;
+	Function::arg_iterator param = fn->arg_begin();
+	for (unsigned i=0; i < params.size(); ++i, ++param) {
+		inputs.push_back(param);
 	}
+	Value* count = param;
 
-	vector<Type*> func_proto(1, float_vec_const);
-	FunctionType* ftype_vec_vec = FunctionType::get(
-		float_vec_const, func_proto, false);
+	unsigned lanes = jit->lanes;
+	Value* zero = ConstantInt::get(jit->size_type, 0);
+	Value* step = ConstantInt::get(jit->size_type, lanes);
+	Value* ident = reduceIdentity(jit, op);
 
-	#define INTRIN_VEC_VEC(_var, _llvmop) { \
-		_var = mod->getFunction("llvm." _llvmop ".v4f32"); \
-		if (!_var) { \
-			_var = Function::Create( \
-				ftype_vec_vec, GlobalValue::ExternalLinkage, \
-				"llvm." _llvmop ".v4f32", mod); \
-			_var->setCallingConv(CallingConv::C); \
+	Value* bulk = jit->builder->CreateAnd(count,
+		ConstantInt::get(jit->size_type, ~uint64_t(lanes - 1)));
+	jit->builder->CreateCondBr(jit->builder->CreateICmpNE(bulk, zero),
+		loop, check);
+
+	/* Main loop: each lane keeps its own partial result. */
+	jit->builder->SetInsertPoint(loop);
+	PHINode* idx = jit->builder->CreatePHI(jit->size_type, 2, "i");
+	PHINode* acc = jit->builder->CreatePHI(jit->float_vec_const, 2, "acc");
+	idx->addIncoming(zero, entry);
+	acc->addIncoming(ident, entry);
+	loadVectors(jit, params, inputs, layouts, idx);
+
+	Value* elt = element(jit);
+	if (!elt) {
+		fn->eraseFromParent();
+		return NULL;
+	}
+	Value* acc_next = reduceCombine(jit, op, acc, elt);
+	Value* next = jit->builder->CreateAdd(idx, step);
+	BasicBlock* loop_end = jit->builder->GetInsertBlock();
+	idx->addIncoming(next, loop_end);
+	acc->addIncoming(acc_next, loop_end);
+	jit->builder->CreateCondBr(jit->builder->CreateICmpULT(next, bulk),
+		loop, check);
+
+	jit->builder->SetInsertPoint(check);
+	PHINode* rest = jit->builder->CreatePHI(jit->size_type, 2, "rest");
+	PHINode* bulk_acc = jit->builder->CreatePHI(jit->float_vec_const, 2,
+		"bulk_acc");
+	rest->addIncoming(zero, entry);
+	rest->addIncoming(next, loop_end);
+	bulk_acc->addIncoming(ident, entry);
+	bulk_acc->addIncoming(acc_next, loop_end);
+	jit->builder->CreateCondBr(jit->builder->CreateICmpULT(rest, count),
+		tail, exit);
+
+	/* Lanes past the end contribute the identity. */
+	jit->builder->SetInsertPoint(tail);
+	Type* lane_type = Type::getInt32Ty(ctx);
+	vector<Value*> valid, pos;
+	tailLanes(jit, rest, count, valid, pos);
+	loadLanes(jit, params, inputs, layouts, pos);
+
+	Value* mask = laneMask(jit, valid);
+	jit->lane_mask = mask;
+	elt = element(jit);
+	jit->lane_mask = NULL;
+	if (!elt) {
+		fn->eraseFromParent();
+		return NULL;
+	}
+	elt = jit->builder->CreateSelect(mask, elt, ident);
+	Value* tail_acc = reduceCombine(jit, op, bulk_acc, elt);
+	BasicBlock* tail_end = jit->builder->GetInsertBlock();
+	jit->builder->CreateBr(exit);
+
+	/* One horizontal reduction, halving the vector each step. */
+	jit->builder->SetInsertPoint(exit);
+	PHINode* total = jit->builder->CreatePHI(jit->float_vec_const, 2,
+		"total");
+	total->addIncoming(bulk_acc, check);
+	total->addIncoming(tail_acc, tail_end);
+	Value* vec = total;
+	for (unsigned width = lanes / 2; width; width /= 2) {
+		vector<Constant*> upper;
+		for (unsigned j=0; j < lanes; ++j) {
+			upper.push_back(ConstantInt::get(lane_type,
+				(j < width) ? j + width : j));
+		}
+		Value* half = jit->builder->CreateShuffleVector(vec,
+			UndefValue::get(jit->float_vec_const),
+			ConstantVector::get(ArrayRef<Constant*>(upper)));
+		vec = reduceCombine(jit, op, vec, half);
+	}
+	Value* ret = jit->builder->CreateExtractElement(vec,
+		ConstantInt::get(lane_type, 0));
+	if (op == REDUCE_MEAN) {
+		ret = jit->builder->CreateFDiv(ret,
+			jit->builder->CreateUIToFP(count, jit->float_pod));
+	}
+	jit->builder->CreateRet(ret);
+	jit->finish(fn, start);
+	return fn;
+}
+
+/* Only foreign definitions know what to do with several values. */
+Value* ASTTuple::codeGen(JIT*) {
+	return NULL;
+}
+
+void ASTTuple::canonical(ASTKey& key) {
+	key.text += "[";
+	for (unsigned k=0; k < elts.size(); ++k) {
+		key.text += k ? " " : "";
+		elts[k]->canonical(key);
+	}
+	key.text += "]";
+}
+
+ASTNode* ASTTuple::simplify(JIT* jit, ASTArena& arena) {
+	for (unsigned k=0; k < elts.size(); ++k) {
+		elts[k] = arena.simplify(elts[k], jit);
+	}
+	return this;
+}
+
+/* Arithmetic folds left over any number of operands. */
+#define ARITH_FUNC(_fn, _llvmop, _op) \
+	static Value* emit_ ## _fn(JIT* jit, ASTCall*, vector<Value*>& vals) { \
+		Value* ret = vals[0]; \
+		for (unsigned i=1; i < vals.size(); ++i) { \
+			ret = relaxed(jit, jit->builder->Create ## _llvmop ( \
+				ret, vals[i], "")); \
+		} \
+		return ret; \
+	} \
+	static double step_ ## _fn(double a, double b) { \
+		return a _op b; \
+	} \
+	static double fold_ ## _fn(const vector<double>& nums) { \
+		double out = nums[0]; \
+		for (unsigned i=1; i < nums.size(); ++i) { \
+			out = step_ ## _fn(out, nums[i]); \
 		} \
+		return out; \
 	} \
 
-	INTRIN_VEC_VEC(vsqrt, "sqrt");
-	INTRIN_VEC_VEC(vsin, "sin");
-	INTRIN_VEC_VEC(vcos, "cos");
-	INTRIN_VEC_VEC(vexp, "exp");
-	INTRIN_VEC_VEC(vlog, "log");
+ARITH_FUNC(add, FAdd, +)
+ARITH_FUNC(sub, FSub, -)
+ARITH_FUNC(mul, FMul, *)
+ARITH_FUNC(div, FDiv, /)
 
-	func_proto.push_back(float_vec_const);
-	ftype_vec_vec = FunctionType::get(
-		float_vec_const, func_proto, false);
-	INTRIN_VEC_VEC(vpow, "pow");
+#undef ARITH_FUNC
 
-	#undef INTRIN_VEC_VEC
+/* Transcendentals are inlined as polynomials unless libm accuracy
+ * was asked for. */
+#define SPECIAL_FUNC(_fn, _jvar, _inline) \
+	static Value* emit_ ## _fn(JIT* jit, ASTCall*, vector<Value*>& vals) { \
+		if (jit->inlineMath()) { \
+			return _inline(jit, vals[0]); \
+		} \
+		return jit->builder->CreateCall(jit->_jvar, vals[0], ""); \
+	} \
+	static double fold_ ## _fn(const vector<double>& nums) { \
+		return _fn(nums[0]); \
+	} \
 
-	optimizer = new FunctionPassManager(mod);
-	optimizer->add(createBasicAliasAnalysisPass());
-	optimizer->add(createInstructionCombiningPass());
-	optimizer->add(createReassociatePass());
-	optimizer->add(createGVNPass());
-	optimizer->add(createCFGSimplificationPass());
-	optimizer->doInitialization();
+SPECIAL_FUNC(sin, vsin, vmath_sin)
+SPECIAL_FUNC(cos, vcos, vmath_cos)
+SPECIAL_FUNC(exp, vexp, vmath_exp)
+SPECIAL_FUNC(log, vlog, vmath_log)
+
+#undef SPECIAL_FUNC
+
+static Value* emit_sqrt(JIT* jit, ASTCall*, vector<Value*>& vals) {
+	return jit->builder->CreateCall(jit->vsqrt, vals[0], "");
 }
 
-JIT::~JIT() {
-	delete optimizer;
-	delete mod;
+static double fold_sqrt(const vector<double>& nums) {
+	return sqrt(nums[0]);
 }
 
-JITMachine::JITMachine() {
-	jit = new JIT();
+static Value* emit_fma(JIT* jit, ASTCall*, vector<Value*>& vals) {
+	return jit->builder->CreateCall3(jit->vfma,
+		vals[0], vals[1], vals[2], "");
 }
 
-JITMachine::~JITMachine() {
-	delete jit;
+static double fold_fma(const vector<double>& nums) {
+	return nums[0] * nums[1] + nums[2];
 }
 
-void JITMachine::jit_internal(string expr) {
-	ASTNode* ast = Parser(expr).parse();
-	if (!ast) return;
-	jit_internal_ast(ast);
+/* Integer powers by square-and-multiply. */
+static Value* emit_powi(JIT* jit, ASTCall* call, vector<Value*>& vals) {
+	ASTNumber* exponent = dynamic_cast<ASTNumber*>(call->args.back());
+	if (!exponent) return NULL;
+	int n = int(exponent->num);
+	Value* base = vals[0];
+	Value* one = ASTNumber(1.0).codeGen(jit);
+	Value* ret;
+	for (ret = one; n; n /= 2) {
+		if (n % 2) {
+			ret = (ret == one) ? base
+				: relaxed(jit, jit->builder->CreateFMul(ret, base));
+		}
+		if (n / 2) {
+			base = relaxed(jit, jit->builder->CreateFMul(base, base));
+		}
+	}
+	if (exponent->num < 0) {
+		ret = relaxed(jit, jit->builder->CreateFDiv(one, ret));
+	}
+	return ret;
 }
 
-void JITMachine::jit_internal_ast(ASTNode* ast) {
-	ASTDef* toplevel = dynamic_cast<ASTDef*>(ast);
-	if (toplevel && typeid(toplevel) == typeid(ASTDef*)) {
-		toplevel->codeGen(jit);
+/* exp(y log|x|) magnifies the rounding of y log|x| with the result,
+ * past 2 ulp, so only the fast tier inlines it. */
+static Value* emit_pow(JIT* jit, ASTCall*, vector<Value*>& vals) {
+	if (jit->inlineMath() && jit->math_tier == MATH_FAST) {
+		return vmath_pow(jit, vals[0], vals[1]);
 	}
-	delete ast;
+	return jit->builder->CreateCall2(jit->vpow, vals[0], vals[1], "");
 }
 
-void* JITMachine::jit_external(string defn) {
-	ASTNode* ast = Parser(defn).parse();
-	if (!ast) return NULL;
-	return jit_external_ast(ast);
+static double fold_pow(const vector<double>& nums) {
+	return pow(nums[0], nums[1]);
 }
 
-void* JITMachine::jit_external_ast(ASTNode* ast) {
-	void* func = NULL;
-	ASTDef* toplevel = dynamic_cast<ASTDef*>(ast);
-	if (toplevel && typeid(toplevel) == typeid(ASTDef*)) {
-		ASTForeignDef fdef(toplevel);
-		Value* val = fdef.codeGen(jit);
-		if (!val) {
-			goto done;
-		}
-		Function* fn = static_cast<Function*>(val);
-		func = jit->jit->getPointerToFunction(fn);
+/* Comparisons are 1.0 where they hold and 0.0 elsewhere, so that
+ * they compose with arithmetic. Only 'if' looks through to the mask. */
+#define COMPARE_FUNC(_fn, _llvmcmp, _op) \
+	static Value* emit_ ## _fn(JIT* jit, ASTCall*, vector<Value*>& vals) { \
+		return jit->builder->CreateUIToFP(jit->builder->CreateFCmp ## _llvmcmp( \
+			vals[0], vals[1]), jit->float_vec_const); \
+	} \
+	static double fold_ ## _fn(const vector<double>& nums) { \
+		return (nums[0] _op nums[1]) ? 1.0 : 0.0; \
+	} \
+
+COMPARE_FUNC(lt, OLT, <)
+COMPARE_FUNC(le, OLE, <=)
+COMPARE_FUNC(gt, OGT, >)
+COMPARE_FUNC(ge, OGE, >=)
+COMPARE_FUNC(eq, OEQ, ==)
+COMPARE_FUNC(ne, UNE, !=)
+
+#undef COMPARE_FUNC
+
+/* A lane mask for a condition: a comparison's own, or non-zero. */
+static Value* conditionMask(JIT* jit, Value* cond) {
+	UIToFPInst* flag = dyn_cast<UIToFPInst>(cond);
+	if (flag && flag->getSrcTy()->getScalarType()->isIntegerTy(1)) {
+		return flag->getOperand(0);
 	}
+	return jit->builder->CreateFCmpUNE(cond,
+		ConstantFP::get(jit->float_vec_const, 0.0));
+}
 
-done:
-	delete ast;
-	return func;
+/* (if c a b) blends per lane; both sides are always evaluated. */
+static Value* emit_if(JIT* jit, ASTCall*, vector<Value*>& vals) {
+	return jit->builder->CreateSelect(conditionMask(jit, vals[0]),
+		vals[1], vals[2]);
 }
 
-void* JITMachine::jit_external_expr(string expr, vector<string> params) {
-	ASTNode* ast = Parser(expr).parse();
-	if (!ast) return NULL;
-	return jit_external_expr_ast(ast, params);
+static double fold_if(const vector<double>& nums) {
+	return (nums[0] != 0.0) ? nums[1] : nums[2];
 }
 
-void* JITMachine::jit_external_expr_ast(ASTNode* ast, vector<string> params) {
+/* Comparisons with NaN fail, so NaNs after the first operand are
+ * skipped. */
+#define MINMAX_FUNC(_fn, _llvmcmp, _op) \
+	static Value* emit_ ## _fn(JIT* jit, ASTCall*, vector<Value*>& vals) { \
+		Value* ret = vals[0]; \
+		for (unsigned i=1; i < vals.size(); ++i) { \
+			ret = jit->builder->CreateSelect(jit->builder->CreateFCmp \
+				## _llvmcmp(vals[i], ret), vals[i], ret); \
+		} \
+		return ret; \
+	} \
+	static double fold_ ## _fn(const vector<double>& nums) { \
+		double out = nums[0]; \
+		for (unsigned i=1; i < nums.size(); ++i) { \
+			out = (nums[i] _op out) ? nums[i] : out; \
+		} \
+		return out; \
+	} \
+
+MINMAX_FUNC(min, OLT, <)
+MINMAX_FUNC(max, OGT, >)
+
+#undef MINMAX_FUNC
+
+static Value* emit_abs(JIT* jit, ASTCall*, vector<Value*>& vals) {
+	return vmath_abs(jit, vals[0]);
+}
+
+static double fold_abs(const vector<double>& nums) {
+	return fabs(nums[0]);
+}
+
+static Value* emit_floor(JIT* jit, ASTCall*, vector<Value*>& vals) {
+	return vmath_floor(jit, vals[0]);
+}
+
+static double fold_floor(const vector<double>& nums) {
+	return floor(nums[0]);
+}
+
+/* Lanes form groups of four, xyzw, whatever the vector width, and
+ * these builtins shuffle and reduce within each group. Kernels step
+ * by whole vectors, so arrays of points line up with the groups.
+ * They cannot be folded, as the values of other lanes are unknown. */
+
+/* In a kernel's last, partial vector, lanes past the end hold copies
+ * of a real element; builtins across lanes see 'fill' there instead,
+ * the identity of what they compute. */
+static Value* padLanes(JIT* jit, Value* v, double fill) {
+	jit->crossed = true;
+	if (!jit->lane_mask) {
+		return v;
+	}
+	return jit->builder->CreateSelect(jit->lane_mask, v,
+		ConstantFP::get(jit->float_vec_const, fill));
+}
+
+static bool laneIndex(ASTNode* node, unsigned limit, unsigned& lane) {
+	ASTNumber* num = dynamic_cast<ASTNumber*>(node);
+	if (!num || num->num < 0 || num->num >= limit
+		|| num->num != floor(num->num))
+	{
+		return false;
+	}
+	lane = unsigned(num->num);
+	return true;
+}
+
+/* Indices below 4 pick from a's group, the rest from b's. */
+static Value* quadShuffle(JIT* jit, Value* a, Value* b,
+	const unsigned idx[4])
+{
+	Type* lane_type = Type::getInt32Ty(jit->mod->getContext());
+	vector<Constant*> mask;
+	for (unsigned j=0; j < jit->lanes; ++j) {
+		unsigned group = j & ~3u;
+		unsigned pick = idx[j & 3];
+		mask.push_back(ConstantInt::get(lane_type, (pick < 4)
+			? group + pick : jit->lanes + group + pick - 4));
+	}
+	return jit->builder->CreateShuffleVector(a, b,
+		ConstantVector::get(ArrayRef<Constant*>(mask)));
+}
+
+static Value* addLanes(JIT* jit, Value* a, Value* b) {
+	return relaxed(jit, jit->builder->CreateFAdd(a, b));
+}
+
+static Value* minLanes(JIT* jit, Value* a, Value* b) {
+	return jit->builder->CreateSelect(jit->builder->CreateFCmpOLT(b, a),
+		b, a);
+}
+
+static Value* maxLanes(JIT* jit, Value* a, Value* b) {
+	return jit->builder->CreateSelect(jit->builder->CreateFCmpOGT(b, a),
+		b, a);
+}
+
+/* Every lane of a group gets the whole group combined, in two
+ * steps: neighbours, then halves. */
+static Value* quadReduce(JIT* jit, Value* v,
+	Value* (*combine)(JIT*, Value*, Value*))
+{
+	static const unsigned pairs[4] = { 1, 0, 3, 2 };
+	static const unsigned halves[4] = { 2, 3, 0, 1 };
+	Value* t = combine(jit, v, quadShuffle(jit, v, v, pairs));
+	return combine(jit, t, quadShuffle(jit, t, t, halves));
+}
+
+/* (swizzle v i j k l) */
+static Value* emit_swizzle(JIT* jit, ASTCall* call, vector<Value*>& vals) {
+	unsigned idx[4];
+	for (unsigned k=0; k < 4; ++k) {
+		if (!laneIndex(call->args[k + 1], 4, idx[k])) return NULL;
+	}
+	Value* v = padLanes(jit, vals[0], 0.0);
+	return quadShuffle(jit, v, v, idx);
+}
+
+/* (shuffle a b i j k l), with 4 to 7 picking from b */
+static Value* emit_shuffle(JIT* jit, ASTCall* call, vector<Value*>& vals) {
+	unsigned idx[4];
+	for (unsigned k=0; k < 4; ++k) {
+		if (!laneIndex(call->args[k + 2], 8, idx[k])) return NULL;
+	}
+	return quadShuffle(jit, padLanes(jit, vals[0], 0.0),
+		padLanes(jit, vals[1], 0.0), idx);
+}
+
+/* (broadcast v i) */
+static Value* emit_broadcast(JIT* jit, ASTCall* call,
+	vector<Value*>& vals)
+{
+	unsigned lane;
+	if (!laneIndex(call->args[1], 4, lane)) return NULL;
+	unsigned idx[4] = { lane, lane, lane, lane };
+	Value* v = padLanes(jit, vals[0], 0.0);
+	return quadShuffle(jit, v, v, idx);
+}
+
+static Value* emit_hsum(JIT* jit, ASTCall*, vector<Value*>& vals) {
+	return quadReduce(jit, padLanes(jit, vals[0], 0.0), addLanes);
+}
+
+static Value* emit_hmin(JIT* jit, ASTCall*, vector<Value*>& vals) {
+	return quadReduce(jit, padLanes(jit, vals[0], HUGE_VAL), minLanes);
+}
+
+static Value* emit_hmax(JIT* jit, ASTCall*, vector<Value*>& vals) {
+	return quadReduce(jit, padLanes(jit, vals[0], -HUGE_VAL), maxLanes);
+}
+
+static Value* emit_dot4(JIT* jit, ASTCall*, vector<Value*>& vals) {
+	return quadReduce(jit, padLanes(jit, relaxed(jit,
+		jit->builder->CreateFMul(vals[0], vals[1])), 0.0), addLanes);
+}
+
+static const Builtin builtin_table[] = {
+	{ "+", 2, 0, emit_add, fold_add, step_add },
+	{ "-", 2, 0, emit_sub, fold_sub, step_sub },
+	{ "*", 2, 0, emit_mul, fold_mul, step_mul },
+	{ "/", 2, 0, emit_div, fold_div, step_div },
+	{ "sqrt", 1, 1, emit_sqrt, fold_sqrt, NULL },
+	{ "sin", 1, 1, emit_sin, fold_sin, NULL },
+	{ "cos", 1, 1, emit_cos, fold_cos, NULL },
+	{ "exp", 1, 1, emit_exp, fold_exp, NULL },
+	{ "log", 1, 1, emit_log, fold_log, NULL },
+	{ "fma", 3, 3, emit_fma, fold_fma, NULL },
+	{ "pow.int", 2, 2, emit_powi, fold_pow, NULL },
+	{ "pow", 2, 2, emit_pow, fold_pow, NULL },
+	{ "<", 2, 2, emit_lt, fold_lt, NULL },
+	{ "<=", 2, 2, emit_le, fold_le, NULL },
+	{ ">", 2, 2, emit_gt, fold_gt, NULL },
+	{ ">=", 2, 2, emit_ge, fold_ge, NULL },
+	{ "=", 2, 2, emit_eq, fold_eq, NULL },
+	{ "!=", 2, 2, emit_ne, fold_ne, NULL },
+	{ "if", 3, 3, emit_if, fold_if, NULL },
+	{ "select", 3, 3, emit_if, fold_if, NULL },
+	{ "min", 2, 0, emit_min, fold_min, NULL },
+	{ "max", 2, 0, emit_max, fold_max, NULL },
+	{ "abs", 1, 1, emit_abs, fold_abs, NULL },
+	{ "floor", 1, 1, emit_floor, fold_floor, NULL },
+	{ "swizzle", 5, 5, emit_swizzle, NULL, NULL },
+	{ "shuffle", 6, 6, emit_shuffle, NULL, NULL },
+	{ "broadcast", 2, 2, emit_broadcast, NULL, NULL },
+	{ "hsum", 1, 1, emit_hsum, NULL, NULL },
+	{ "hmin", 1, 1, emit_hmin, NULL, NULL },
+	{ "hmax", 1, 1, emit_hmax, NULL, NULL },
+	{ "dot4", 2, 2, emit_dot4, NULL, NULL },
+};
+
+/* Builtins only claim calls with an arity they accept; others fall
+ * through to user definitions of the same name. */
+const Builtin* JIT::builtin(StringRef name, size_t nargs) {
+	const Builtin* fn = builtins.lookup(name);
+	if (!fn || nargs < fn->min_args
+		|| (fn->max_args && nargs > fn->max_args))
+	{
+		return NULL;
+	}
+	return fn;
+}
+
+/* Folds as a kernel computes: the arithmetic type rounds every step,
+ * so (+ 16777216 1 1) is 16777216 in float. */
+double foldBuiltin(const Builtin* fn, const vector<double>& nums,
+	precision_t prec)
+{
+	bool wide = (prec == PRECISION_F64);
+	if (!fn->step) {
+		double out = fn->fold(nums);
+		return wide ? out : double(float(out));
+	}
+	double out = nums[0];
+	for (unsigned i=1; i < nums.size(); ++i) {
+		out = fn->step(out, nums[i]);
+		out = wide ? out : double(float(out));
+	}
+	return out;
+}
+
+Value* ASTCall::codeGen(JIT* jit) {
+	/* Generate code for all child nodes. */
+	vector<Value*> vals;
+	arg_list::iterator it = args.begin();
+	for (; it != args.end(); ++it) {
+		Value* code = jit->generate(*it);
+		if (!code) return NULL;
+		vals.push_back(code);
+	}
+
+	const Builtin* builtin = jit->builtin(name, vals.size());
+	if (builtin) {
+		return builtin->emit(jit, this, vals);
+	}
+
+	/* Calling a definition that works across lanes makes the caller
+	 * one too, and passes a tail's lanes in range on. */
+	Function* fn = jit->userFunction(name);
+	if (fn && jit->crossing.count(jit->defName(name))) {
+		jit->crossed = true;
+		if (jit->lane_mask) {
+			vals.push_back(jit->lane_mask);
+		}
+	}
+	if (!fn || fn->arg_size() != vals.size()) {
+		return NULL;
+	} else {
+		return jit->builder->CreateCall(fn,
+			ArrayRef<Value*>(vals), "");
+	}
+}
+
+void ASTCall::canonical(ASTKey& key) {
+	/* A shared subexpression is written out once, then referenced. */
+	map<ASTNode*, unsigned>::iterator seen = key.shared.find(this);
+	if (seen != key.shared.end()) {
+		key.text += "@" + utostr(seen->second);
+		return;
+	}
+	unsigned index = key.shared.size();
+	key.shared[this] = index;
+
+	key.text += "(";
+	key.text += name;
+	arg_list::iterator it = args.begin();
+	for (; it != args.end(); ++it) {
+		key.text += " ";
+		(*it)->canonical(key);
+	}
+	key.text += ")";
+	key.calls.insert(name.str());
+}
+
+/* Unbound names are zero, as in the interpreter and differentiator. */
+Value* ASTVar::codeGen(JIT* jit) {
+	Value* val = jit->symbols.lookup(ident);
+	if (!val) {
+		ASTNumber zero(0.0);
+		return zero.codeGen(jit);
+	}
+	return val;
+}
+
+void ASTVar::canonical(ASTKey& key) {
+	for (unsigned i=0; i < key.params.size(); ++i) {
+		if (key.params[i] == ident) {
+			key.text += "$" + utostr(i);
+			return;
+		}
+	}
+	key.text += ident;
+}
+
+Value* ASTNumber::codeGen(JIT* jit) {
+	return ConstantFP::get(jit->float_vec_const, num);
+}
+
+void ASTNumber::canonical(ASTKey& key) {
+	key.text += "#" + utohexstr(DoubleToBits(num));
+}
+
+ASTNode* ASTDef::simplify(JIT* jit, ASTArena& arena) {
+	body = arena.simplify(body, jit);
+	return this;
+}
+
+ASTNode* ASTCall::takeFront() {
+	ASTNode* front = args.front();
+	args.erase(args.begin());
+	return front;
+}
+
+static bool isNumber(ASTNode* node, double num) {
+	ASTNumber* val = dynamic_cast<ASTNumber*>(node);
+	return val && val->num == num && signbit(val->num) == signbit(num);
+}
+
+ASTNode* ASTCall::simplify(JIT* jit, ASTArena& arena) {
+	/* Children first, so that constants propagate upward. */
+	vector<double> nums;
+	arg_list::iterator it = args.begin();
+	for (; it != args.end(); ++it) {
+		*it = arena.simplify(*it, jit);
+		ASTNumber* val = dynamic_cast<ASTNumber*>(*it);
+		if (val) {
+			nums.push_back(jit->round(val->num));
+		}
+	}
+
+	/* Each step of + - * / rounds as the kernel would; other builtins
+	 * fold in double and round once, which is exact for sqrt and at
+	 * least as accurate as float libm elsewhere. */
+	const Builtin* builtin = jit->builtin(name, args.size());
+	if (builtin && builtin->fold && nums.size() == args.size()) {
+		return new (arena) ASTNumber(foldBuiltin(builtin, nums,
+			jit->precision));
+	}
+
+	bool fast = jit->fast_math;
+	bool arith = (name == "+" || name == "-" || name == "*" || name == "/");
+	bool commutes = (name == "+" || name == "*");
+
+	/* Gathering constants reorders the operations. */
+	if (fast && commutes && nums.size() >= 2) {
+		double acc = (name == "+") ? 0.0 : 1.0;
+		for (it = args.begin(); it != args.end(); ) {
+			ASTNumber* val = dynamic_cast<ASTNumber*>(*it);
+			if (!val) {
+				++it;
+				continue;
+			}
+			acc = jit->round((name == "+") ? acc + val->num
+				: acc * val->num);
+			it = args.erase(it);
+		}
+		args.push_back(new (arena) ASTNumber(acc));
+	}
+
+	/* Drop operands that cannot change the result. Only -0 is an
+	 * exact additive identity; x + 0 turns -0 into +0. */
+	if (arith && args.size() >= 2) {
+		it = args.begin();
+		if (!commutes) ++it;
+		while (it != args.end() && args.size() > 1) {
+			bool identity =
+				(name == "+" && (isNumber(*it, -0.0)
+					|| (fast && isNumber(*it, 0.0))))
+				|| (name == "-" && isNumber(*it, 0.0))
+				|| ((name == "*" || name == "/") && isNumber(*it, 1.0));
+			if (identity) {
+				it = args.erase(it);
+			} else {
+				++it;
+			}
+		}
+		if (args.size() == 1) {
+			return takeFront();
+		}
+	}
+
+	/* Without NaNs and infinities to preserve, x * 0 is 0. */
+	if (fast && name == "*") {
+		for (it = args.begin(); it != args.end(); ++it) {
+			if (isNumber(*it, 0.0) || isNumber(*it, -0.0)) {
+				return new (arena) ASTNumber(0.0);
+			}
+		}
+	}
+
+	/* Divide by constants as a multiply by the reciprocal. Without
+	 * fast math this only happens when the reciprocal is exact. */
+	if (name == "/" && args.size() >= 2) {
+		double divisor = 1.0;
+		bool constant = true;
+		for (it = args.begin() + 1; it != args.end(); ++it) {
+			ASTNumber* val = dynamic_cast<ASTNumber*>(*it);
+			if (!val) {
+				constant = false;
+				break;
+			}
+			divisor = jit->round(divisor * val->num);
+		}
+
+		int exp;
+		double recip = jit->round(1.0 / divisor);
+		double tiny = (jit->precision == PRECISION_F64) ? DBL_MIN : FLT_MIN;
+		bool exact = (frexp(divisor, &exp) == 0.5) && fabs(recip) >= tiny
+			&& recip * divisor == 1.0;
+		if (constant && (exact || fast) && divisor != 0.0) {
+			args.resize(1);
+			name = "*";
+			args.push_back(new (arena) ASTNumber(recip));
+		}
+	}
+
+	/* A constant condition picks one side. */
+	ASTNumber* cond = args.empty() ? NULL
+		: dynamic_cast<ASTNumber*>(args.front());
+	if ((name == "if" || name == "select") && args.size() == 3 && cond) {
+		return args[(cond->num != 0.0) ? 1 : 2];
+	}
+
+	/* Integer powers become a chain of multiplies: x * x and 1 / x
+	 * round as pow does, longer chains only nearly. */
+	if (name == "pow" && args.size() == 2) {
+		ASTNumber* exponent = dynamic_cast<ASTNumber*>(args.back());
+		double n = exponent ? exponent->num : 0.5;
+		if (n == 0.0) {
+			return new (arena) ASTNumber(1.0);
+		} else if (n == 1.0) {
+			return takeFront();
+		} else if (n == 2.0 || n == -1.0
+			|| (fast && n == floor(n) && fabs(n) <= 32))
+		{
+			name = "pow.int";
+		}
+	}
+
+	/* With fast math, a * b + c contracts to a fused multiply-add.
+	 * Other parents may share this node and 'mul', so both are left
+	 * alone, and the sum of the rest is simplified in turn, to
+	 * contract its own products. */
+	if (fast && name == "+" && args.size() >= 2) {
+		for (unsigned i=0; i < args.size(); ++i) {
+			ASTCall* mul = dynamic_cast<ASTCall*>(args[i]);
+			if (!mul || mul->name != "*" || mul->args.size() != 2) {
+				continue;
+			}
+			ASTCall* rest = new (arena) ASTCall("+");
+			for (unsigned j=0; j < args.size(); ++j) {
+				if (j != i) {
+					rest->args.push_back(args[j]);
+				}
+			}
+			ASTCall* fma = new (arena) ASTCall("fma");
+			fma->args.append(mul->args.begin(), mul->args.end());
+			fma->args.push_back((rest->args.size() == 1) ? rest->args[0]
+				: arena.simplify(rest, jit));
+			return fma;
+		}
+	}
+
+	return this;
+}
+
+/* Tallies the size of everything the engine emits, and of what it
+ * still holds. Called with the engine lock held. */
+struct CodeSizeListener : public JITEventListener {
+	jit_stats* stats;
+	size_t* resident;
+	DenseMap<void*, size_t> sizes;
+
+	CodeSizeListener(jit_stats* _stats, size_t* _resident)
+		: stats(_stats), resident(_resident)
+	{}
+
+	virtual void NotifyFunctionEmitted(const Function&, void* code,
+		size_t size, const EmittedFunctionDetails&)
+	{
+		stats->code_bytes += size;
+		*resident += size;
+		sizes[code] = size;
+	}
+
+	virtual void NotifyFreeingMachineCode(void* code) {
+		*resident -= sizes.lookup(code);
+		sizes.erase(code);
+	}
+};
+
+static void feature(vector<string>& attrs, const char* name, bool on) {
+	attrs.push_back(string(on ? "+" : "-") + name);
+}
+
+/* The host's vector features, as LLVM 3.2 names them, each on or off:
+ * the CPU name alone may imply AVX the OS has not enabled, and
+ * sys::getHostCPUFeatures() knows nothing of x86. */
+static vector<string> host_features() {
+	vector<string> attrs;
+#if defined(__i386__) || defined(__x86_64__)
+	unsigned eax, ebx, ecx, edx;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		return attrs;
+	}
+
+	/* AVX state must be enabled by the OS, not just the CPU. */
+	const unsigned osxsave = 1 << 27, avx_bit = 1 << 28;
+	bool avx = false;
+	if ((ecx & (osxsave | avx_bit)) == (osxsave | avx_bit)) {
+		unsigned xcr0, xcr0_hi;
+		__asm__("xgetbv" : "=a"(xcr0), "=d"(xcr0_hi) : "c"(0));
+		avx = (xcr0 & 0x6) == 0x6;
+	}
+	feature(attrs, "sse3", ecx & (1 << 0));
+	feature(attrs, "ssse3", ecx & (1 << 9));
+	feature(attrs, "sse41", ecx & (1 << 19));
+	feature(attrs, "sse42", ecx & (1 << 20));
+	feature(attrs, "popcnt", ecx & (1 << 23));
+	feature(attrs, "avx", avx);
+	feature(attrs, "fma", avx && (ecx & (1 << 12)));
+	feature(attrs, "f16c", avx && (ecx & (1 << 29)));
+
+	bool avx2 = false;
+	if (avx && __get_cpuid_max(0, NULL) >= 7) {
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		avx2 = ebx & (1 << 5);
+	}
+	feature(attrs, "avx2", avx2);
+#endif
+	return attrs;
+}
+
+/* The widest float vector the target executes natively: 8 with AVX,
+ * as LLVM 3.2 cannot generate AVX-512, and 4 otherwise. */
+static unsigned host_lanes() {
+	vector<string> attrs = host_features();
+	return (find(attrs.begin(), attrs.end(), "+avx") != attrs.end())
+		? 8 : 4;
+}
+
+/* The engines share process-wide state (the target registry, and the
+ * resolver's list of JITs), so they are created, emit code and are
+ * destroyed one at a time. Everything else runs concurrently. */
+static pthread_mutex_t engine_lock = PTHREAD_MUTEX_INITIALIZER;
+
+JIT::JIT(unsigned _lanes, DefRegistry* _defs)
+	: context(new LLVMContext()), quick(false), lanes(_lanes),
+	  math_tier(MATH_LIBM), fast_math(false), table_error(0), defs(_defs),
+	  code_resident(0), lane_mask(NULL), crossed(false), nested_ms(0)
+{
+	mod = new Module("jit", *context);
+	builder = new IRBuilder<>(*context);
+
+	if (lanes != 4 && lanes != 8 && lanes != 16) {
+		lanes = host_lanes();
+	}
+
+	string errs;
+	pthread_mutex_lock(&engine_lock);
+	InitializeNativeTarget();
+	InitializeNativeTargetAsmPrinter();
+	jit = EngineBuilder(mod).setErrorStr(&errs)
+		.setMCPU(sys::getHostCPUName()).setMAttrs(host_features())
+		.create();
+	pthread_mutex_unlock(&engine_lock);
+	if (!jit) {
+		cerr << errs.c_str() << endl;
+	}
+
+	void_ret = Type::getVoidTy(mod->getContext());
+	size_type = IntegerType::get(mod->getContext(), sizeof(size_t) * 8);
+	result_type = PointerType::get(
+		IntegerType::get(mod->getContext(), 8), 0);
+	setPrecision(PRECISION_F32);
+
+	for (unsigned i=0; i < array_lengthof(builtin_table); ++i) {
+		builtins[builtin_table[i].name] = &builtin_table[i];
+	}
+
+	optimizer = new FunctionPassManager(mod);
+	optimizer->add(createBasicAliasAnalysisPass());
+	optimizer->add(createInstructionCombiningPass());
+	optimizer->add(createReassociatePass());
+	optimizer->add(createGVNPass());
+	optimizer->add(createCFGSimplificationPass());
+	optimizer->doInitialization();
+
+	setInlineThreshold(225);
+
+	listener = new CodeSizeListener(&stats, &code_resident);
+	if (jit) {
+		jit->RegisterJITEventListener(listener);
+	}
+}
+
+/* Element types: what kernels compute with, and what they store. */
+static Type* computeType(LLVMContext& ctx, precision_t prec) {
+	return (prec == PRECISION_F64) ? Type::getDoubleTy(ctx)
+		: Type::getFloatTy(ctx);
+}
+
+static Type* storageType(LLVMContext& ctx, precision_t prec) {
+	return (prec == PRECISION_F16) ? Type::getInt16Ty(ctx)
+		: computeType(ctx, prec);
+}
+
+static unsigned storageBytes(precision_t prec) {
+	return (prec == PRECISION_F64) ? 8 : (prec == PRECISION_F16) ? 2 : 4;
+}
+
+/* Retargets the types and intrinsics that code generation uses. */
+void JIT::setPrecision(precision_t prec) {
+	LLVMContext& ctx = mod->getContext();
+	precision = prec;
+	float_pod = computeType(ctx, prec);
+	float_vec_const = VectorType::get(float_pod, lanes);
+	Type* store_pod = storageType(ctx, prec);
+	float_ptr = PointerType::get(store_pod, 0);
+	store_vec_const = VectorType::get(store_pod, lanes);
+	float_vec = PointerType::get(store_vec_const, 0);
+	store_bytes = storageBytes(prec);
+
+	vector<Type*> func_proto(1, float_vec_const);
+	FunctionType* ftype_vec_vec = FunctionType::get(
+		float_vec_const, func_proto, false);
+
+	/* Overloaded on the vector type, e.g. llvm.sin.v8f32. */
+	string vsuffix = ".v" + utostr(lanes)
+		+ (float_pod->isDoubleTy() ? "f64" : "f32");
+
+	#define INTRIN_VEC_VEC(_var, _llvmop) { \
+		_var = mod->getFunction("llvm." _llvmop + vsuffix); \
+		if (!_var) { \
+			_var = Function::Create( \
+				ftype_vec_vec, GlobalValue::ExternalLinkage, \
+				"llvm." _llvmop + vsuffix, mod); \
+			_var->setCallingConv(CallingConv::C); \
+		} \
+	} \
+
+	INTRIN_VEC_VEC(vsqrt, "sqrt");
+	INTRIN_VEC_VEC(vsin, "sin");
+	INTRIN_VEC_VEC(vcos, "cos");
+	INTRIN_VEC_VEC(vexp, "exp");
+	INTRIN_VEC_VEC(vlog, "log");
+
+	func_proto.push_back(float_vec_const);
+	ftype_vec_vec = FunctionType::get(
+		float_vec_const, func_proto, false);
+	INTRIN_VEC_VEC(vpow, "pow");
+
+	func_proto.push_back(float_vec_const);
+	ftype_vec_vec = FunctionType::get(
+		float_vec_const, func_proto, false);
+	INTRIN_VEC_VEC(vfma, "fmuladd");
+
+	#undef INTRIN_VEC_VEC
+}
+
+/* Half floats are stored narrow but computed on as floats. */
+Value* JIT::widen(Value* stored) {
+	if (precision == PRECISION_F16) {
+		return vmath_half_to_float(this, stored);
+	}
+	return stored;
+}
+
+Value* JIT::narrow(Value* val) {
+	if (precision == PRECISION_F16) {
+		return vmath_float_to_half(this, val);
+	}
+	return val;
+}
+
+/* The polynomials in vmath.cc are written for floats. */
+bool JIT::inlineMath() {
+	return math_tier != MATH_LIBM && float_pod->isFloatTy();
+}
+
+/* Rounds a constant to the arithmetic type. */
+double JIT::round(double num) {
+	return float_pod->isFloatTy() ? double(float(num)) : num;
+}
+
+/* Definitions are compiled once per arithmetic type. */
+/* A definition's code depends on the settings it is compiled under,
+ * so each combination gets a function of its own. */
+string JIT::defName(StringRef name) {
+	string mangled = name.str();
+	if (float_pod->isDoubleTy()) {
+		mangled += ".f64";
+	}
+	if (inlineMath()) {
+		mangled += (math_tier == MATH_FAST) ? ".fast" : ".precise";
+	}
+	if (fast_math) {
+		mangled += ".fm";
+	}
+	if (quick) {
+		mangled += ".quick";
+	}
+	return mangled;
+}
+
+/* Finds a definition for the current settings, compiling it again
+ * from its source if it was defined under others. In a
+ * tail, definitions that work across lanes have a variant taking the
+ * lanes in range. */
+Function* JIT::userFunction(StringRef name) {
+	bool masked = lane_mask && crossing.count(defName(name));
+	string fname = defName(name) + (masked ? ".tail" : "");
+	Function* fn = mod->getFunction(fname);
+	string source = defs->source(name);
+	if (fn || source.empty()) {
+		return fn;
+	}
+
+	/* The time spent here is the definition's, not the caller's. */
+	double begin = now_ms();
+	ASTArena arena;
+	ASTNode* ast = Parser(source, arena).parse();
+	ASTDef* defn = ast ? dynamic_cast<ASTDef*>(ast) : NULL;
+	if (defn) {
+		defn = static_cast<ASTDef*>(arena.simplify(defn, this));
+	}
+	stats.parse_ms += now_ms() - begin;
+	if (!defn) {
+		nested_ms += now_ms() - begin;
+		return NULL;
+	}
+
+	/* The caller is midway through its own code generation, with
+	 * names the definition must not see. */
+	IRBuilderBase::InsertPoint outer_ip = builder->saveIP();
+	DenseMap<ASTNode*, Value*> outer_emitted(emitted);
+	vector<pair<string, Value*> > outer_symbols;
+	StringMap<Value*>::iterator it = symbols.begin();
+	for (; it != symbols.end(); ++it) {
+		outer_symbols.push_back(make_pair(it->getKey().str(),
+			it->getValue()));
+	}
+	Value* outer_mask = lane_mask;
+	if (!masked) {
+		lane_mask = NULL;
+	}
+
+	double outer_nested = nested_ms;
+	nested_ms = 0;
+	defn->codeGen(this);
+	nested_ms = outer_nested + now_ms() - begin;
+
+	builder->restoreIP(outer_ip);
+	emitted = outer_emitted;
+	symbols.clear();
+	for (unsigned i=0; i < outer_symbols.size(); ++i) {
+		symbols[outer_symbols[i].first] = outer_symbols[i].second;
+	}
+	lane_mask = outer_mask;
+
+	/* Whether it works across lanes is only known once compiled. */
+	fn = mod->getFunction(fname);
+	if (fn && !masked && lane_mask && crossing.count(defName(name))) {
+		return userFunction(name);
+	}
+	return fn;
+}
+
+stream_trampoline JIT::streamTrampoline(unsigned nins, unsigned nouts,
+	precision_t prec)
+{
+	pair<precision_t, pair<unsigned, unsigned> > key(prec,
+		make_pair(nins, nouts));
+	if (trampolines.count(key)) {
+		return trampolines[key];
+	}
+
+	/* (float*, ..., float*, ..., size_t) => void, or for reductions
+	 * (float*, ..., size_t) => float, at precision 'prec' */
+	LLVMContext& ctx = mod->getContext();
+	Type* elt_ptr = PointerType::get(storageType(ctx, prec), 0);
+	vector<Type*> kproto(nins + nouts, elt_ptr);
+	kproto.push_back(size_type);
+	FunctionType* ktype = FunctionType::get(
+		nouts ? void_ret : computeType(ctx, prec),
+		ArrayRef<Type*>(kproto), false);
+
+	/* (i8*, float**, float**, size_t) => void */
+	PointerType* array_type = PointerType::get(elt_ptr, 0);
+	vector<Type*> proto;
+	proto.push_back(result_type);
+	proto.push_back(array_type);
+	proto.push_back(array_type);
+	proto.push_back(size_type);
+	FunctionType* ftype = FunctionType::get(void_ret,
+		ArrayRef<Type*>(proto), false);
+	Function* fn = Function::Create(ftype,
+		Function::ExternalLinkage, "trampoline", mod);
+
+	BasicBlock* blk = BasicBlock::Create(mod->getContext(),
+		"trampoline", fn);
+	builder->SetInsertPoint(blk);
+	Function::arg_iterator param = fn->arg_begin();
+	Value* kernel = builder->CreateBitCast(param++,
+		PointerType::get(ktype, 0));
+	Value* ins = param++;
+	Value* outs = param++;
+	Value* count = param;
+
+	vector<Value*> args;
+	for (unsigned i=0; i < nins + nouts; ++i) {
+		Value* array = (i < nins) ? ins : outs;
+		unsigned slot = (i < nins) ? i : i - nins;
+		args.push_back(builder->CreateLoad(builder->CreateConstGEP1_32(
+			array, slot)));
+	}
+	args.push_back(count);
+	Value* ret = builder->CreateCall(kernel, ArrayRef<Value*>(args));
+	if (!nouts) {
+		/* Reductions hand back a double, whatever the precision. */
+		Type* f64 = Type::getDoubleTy(ctx);
+		builder->CreateStore(builder->CreateFPCast(ret, f64),
+			builder->CreateBitCast(builder->CreateLoad(outs),
+				PointerType::get(f64, 0)));
+	}
+	builder->CreateRetVoid();
+	verifyFunction(*fn);
+
+	stream_trampoline func = stream_trampoline(emit(fn));
+	trampolines[key] = func;
+	return func;
+}
+
+/* Each node of the AST is emitted once per body, however many
+ * parents share it. */
+Value* JIT::generate(ASTNode* node) {
+	DenseMap<ASTNode*, Value*>::iterator it = emitted.find(node);
+	if (it != emitted.end()) {
+		return it->second;
+	}
+	Value* val = node->codeGen(this);
+	emitted[node] = val;
+	return val;
+}
+
+/* Values from another body, or another block of this one, are not
+ * in scope. */
+Value* JIT::generateBody(ASTNode* body) {
+	emitted.clear();
+	return generate(body);
+}
+
+static unsigned countInstructions(Function* fn) {
+	unsigned count = 0;
+	for (Function::iterator blk = fn->begin(); blk != fn->end(); ++blk) {
+		count += blk->size();
+	}
+	return count;
+}
+
+/* Verifies and optimizes a function whose IR took since 'start',
+ * besides the definitions compiled for it meanwhile. */
+void JIT::finish(Function* fn, double start) {
+	verifyFunction(*fn);
+	stats.codegen_ms += now_ms() - start - nested_ms;
+	nested_ms = 0;
+	stats.ir_before += countInstructions(fn);
+
+	double opt = now_ms();
+	if (!quick) {
+		optimizer->run(*fn);
+	}
+	stats.optimize_ms += now_ms() - opt;
+	stats.ir_after += countInstructions(fn);
+	++stats.functions;
+}
+
+static bool callsDefinitions(Function* fn) {
+	for (Function::iterator blk = fn->begin(); blk != fn->end(); ++blk) {
+		BasicBlock::iterator inst = blk->begin();
+		for (; inst != blk->end(); ++inst) {
+			CallInst* call = dyn_cast<CallInst>(inst);
+			Function* callee = call ? call->getCalledFunction() : NULL;
+			if (callee && !callee->isDeclaration()) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/* Inlines calls from 'caller' to definitions of fewer instructions
+ * than the threshold, and the calls those bring along, but never a
+ * definition into its own body. Only the caller changes, whatever
+ * else the module holds. */
+void JIT::inlineCalls(Function* caller) {
+	typedef pair<CallInst*, vector<Function*> > site_t;
+	vector<site_t> sites;
+	for (Function::iterator blk = caller->begin(); blk != caller->end();
+		++blk)
+	{
+		BasicBlock::iterator inst = blk->begin();
+		for (; inst != blk->end(); ++inst) {
+			CallInst* call = dyn_cast<CallInst>(inst);
+			if (call) {
+				sites.push_back(site_t(call, vector<Function*>()));
+			}
+		}
+	}
+
+	while (!sites.empty()) {
+		site_t site = sites.back();
+		sites.pop_back();
+		Function* callee = site.first->getCalledFunction();
+		if (!callee || callee->isDeclaration() || callee == caller
+			|| find(site.second.begin(), site.second.end(), callee)
+				!= site.second.end()
+			|| countInstructions(callee) >= inline_threshold)
+		{
+			continue;
+		}
+		InlineFunctionInfo info;
+		if (!InlineFunction(site.first, info)) {
+			continue;
+		}
+		site.second.push_back(callee);
+		for (unsigned i=0; i < info.InlinedCalls.size(); ++i) {
+			CallInst* call = dyn_cast_or_null<CallInst>(
+				&*info.InlinedCalls[i]);
+			if (call) {
+				sites.push_back(site_t(call, site.second));
+			}
+		}
+	}
+}
+
+/* Inlines the definitions kernels call, then optimizes them again. */
+void JIT::finalize(const vector<Function*>& fns) {
+	vector<Function*> callers;
+	for (unsigned i=0; i < fns.size(); ++i) {
+		if (callsDefinitions(fns[i])) {
+			callers.push_back(fns[i]);
+		}
+	}
+	if (quick || !inline_threshold || callers.empty()) {
+		return;
+	}
+
+	double start = now_ms();
+	for (unsigned i=0; i < callers.size(); ++i) {
+		stats.ir_after -= countInstructions(callers[i]);
+	}
+	for (unsigned i=0; i < callers.size(); ++i) {
+		inlineCalls(callers[i]);
+		optimizer->run(*callers[i]);
+		stats.ir_after += countInstructions(callers[i]);
+	}
+	stats.optimize_ms += now_ms() - start;
+}
+
+void JIT::finalize(Function* fn) {
+	finalize(vector<Function*>(1, fn));
+}
+
+void JIT::setInlineThreshold(unsigned threshold) {
+	inline_threshold = threshold;
+}
+
+/* Emits every function in one hold of the engine. */
+vector<void*> JIT::emit(const vector<Function*>& fns) {
+	/* Timed once the engine is ours, not while waiting for it. */
+	vector<void*> code;
+	pthread_mutex_lock(&engine_lock);
+	double start = now_ms();
+	for (unsigned i=0; i < fns.size(); ++i) {
+		code.push_back(jit->getPointerToFunction(fns[i]));
+	}
+	pthread_mutex_unlock(&engine_lock);
+	stats.emit_ms += now_ms() - start;
+	return code;
+}
+
+void* JIT::emit(Function* fn) {
+	return emit(vector<Function*>(1, fn))[0];
+}
+
+/* Frees a kernel's machine code, then its IR. */
+void JIT::discard(Function* fn) {
+	pthread_mutex_lock(&engine_lock);
+	jit->freeMachineCodeForFunction(fn);
+	pthread_mutex_unlock(&engine_lock);
+	fn->eraseFromParent();
+
+	/* Tables no function reads any longer go with it. */
+	vector<GlobalVariable*> unused;
+	DenseMap<GlobalVariable*, void*>::iterator it = tables.begin();
+	for (; it != tables.end(); ++it) {
+		it->first->removeDeadConstantUsers();
+		if (it->first->use_empty()) {
+			unused.push_back(it->first);
+		}
+	}
+	for (unsigned i=0; i < unused.size(); ++i) {
+		pthread_mutex_lock(&engine_lock);
+		jit->updateGlobalMapping(unused[i], NULL);
+		pthread_mutex_unlock(&engine_lock);
+		free(tables[unused[i]]);
+		tables.erase(unused[i]);
+		unused[i]->eraseFromParent();
+	}
+}
+
+/* Everything besides the AST that changes the generated code, down
+ * to the CPU it was generated for, as a cache directory may be shared
+ * between machines. */
+string JIT::configKey() {
+	string key = "c";
+	key += sys::getHostCPUName();
+	vector<string> attrs = host_features();
+	for (unsigned i=0; i < attrs.size(); ++i) {
+		key += (i ? "," : ":") + attrs[i];
+	}
+	key += " v" + utostr(lanes) + " m" + utostr(math_tier)
+		+ " f" + utostr(fast_math) + " i" + utostr(inline_threshold)
+		+ " p" + utostr(precision) + (quick ? " q" : "");
+	if (table_error > 0) {
+		key += " t" + utohexstr(DoubleToBits(table_error));
+		map<string, pair<double, double> >::iterator it = ranges.begin();
+		for (; it != ranges.end(); ++it) {
+			key += " r" + it->first + ":"
+				+ utohexstr(DoubleToBits(it->second.first)) + ":"
+				+ utohexstr(DoubleToBits(it->second.second));
+		}
+	}
+	return key;
+}
+
+/* Writes position-independent native code for 'm' to 'path'. */
+bool JIT::emitObject(Module* m, string path) {
+	EngineBuilder target(m);
+	target.setMCPU(sys::getHostCPUName()).setMAttrs(host_features())
+		.setRelocationModel(Reloc::PIC_);
+	pthread_mutex_lock(&engine_lock);
+	TargetMachine* tm = target.selectTarget();
+	pthread_mutex_unlock(&engine_lock);
+	if (!tm) {
+		return false;
+	}
+
+	string errs;
+	raw_fd_ostream out(path.c_str(), errs, raw_fd_ostream::F_Binary);
+	if (!errs.empty()) {
+		cerr << errs << endl;
+		delete tm;
+		return false;
+	}
+
+	PassManager passes;
+	passes.add(new DataLayout(*tm->getDataLayout()));
+	formatted_raw_ostream fout(out);
+	bool ok = !tm->addPassesToEmitFile(passes, fout,
+		TargetMachine::CGFT_ObjectFile);
+	if (ok) {
+		passes.run(*m);
+	}
+	delete tm;
+	return ok;
+}
+
+JIT::~JIT() {
+	delete optimizer;
+	delete builder;
+
+	/* The engine owns the module. */
+	pthread_mutex_lock(&engine_lock);
+	if (jit) {
+		jit->UnregisterJITEventListener(listener);
+		delete jit;
+	} else {
+		delete mod;
+	}
+	pthread_mutex_unlock(&engine_lock);
+	DenseMap<GlobalVariable*, void*>::iterator it = tables.begin();
+	for (; it != tables.end(); ++it) {
+		free(it->second);
+	}
+	delete listener;
+	delete context;
+}
+
+/* Brings a JIT borrowed from the pool in line with 'settings'. */
+void JIT::configure(const jit_settings& settings) {
+	math_tier = settings.math_tier;
+	fast_math = settings.fast_math;
+	quick = settings.quick;
+	nested_ms = 0;
+	table_error = settings.table_error;
+	ranges = settings.ranges;
+	if (precision != settings.precision) {
+		setPrecision(settings.precision);
+	}
+	if (inline_threshold != settings.inline_threshold) {
+		setInlineThreshold(settings.inline_threshold);
+	}
+}
+
+JITMachine::JITMachine(unsigned lanes)
+	: pool(NULL), defs(new DefRegistry()), cache_links(0), linking(0),
+	  kernel_limit(1024), tier_up_calls(64)
+{
+	/* The pass registry and LLVM's lazily built statics only lock
+	 * once told that threads are about. */
+	pthread_mutex_lock(&engine_lock);
+	if (!llvm_is_multithreaded()) {
+		llvm_start_multithreaded();
+	}
+	pthread_mutex_unlock(&engine_lock);
+
+	jit = new JIT(lanes, defs);
+	jits.push_back(jit);
+	idle.push_back(jit);
+
+	/* Public entry points nest, so the lock is recursive. */
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	pthread_cond_init(&linked, NULL);
+}
+
+JITMachine::~JITMachine() {
+	pthread_mutex_lock(&lock);
+	while (linking) {
+		pthread_cond_wait(&linked, &lock);
+	}
+	pthread_mutex_unlock(&lock);
+	pthread_cond_destroy(&linked);
+	pthread_mutex_destroy(&lock);
+	delete pool;
+	for (unsigned i=0; i < jits.size(); ++i) {
+		delete jits[i];
+	}
+	delete defs;
+	for (unsigned i=0; i < libraries.size(); ++i) {
+		dlclose(libraries[i]);
+	}
+}
+
+DefRegistry::DefRegistry() {
+	pthread_rwlock_init(&_lock, NULL);
+}
+
+DefRegistry::~DefRegistry() {
+	pthread_rwlock_destroy(&_lock);
+}
+
+bool DefRegistry::add(StringRef name, const string& source,
+	const string& key)
+{
+	pthread_rwlock_wrlock(&_lock);
+	bool fresh = !_sources.count(name);
+	if (fresh) {
+		_sources[name] = source;
+		_keys[name] = key;
+	}
+	pthread_rwlock_unlock(&_lock);
+	return fresh;
+}
+
+string DefRegistry::source(StringRef name) {
+	pthread_rwlock_rdlock(&_lock);
+	string source = _sources.lookup(name);
+	pthread_rwlock_unlock(&_lock);
+	return source;
+}
+
+string DefRegistry::key(StringRef name) {
+	pthread_rwlock_rdlock(&_lock);
+	string key = _keys.lookup(name);
+	pthread_rwlock_unlock(&_lock);
+	return key;
+}
+
+/* Holds a machine's lock for one scope. */
+class ScopedLock {
+	pthread_mutex_t* _mutex;
+
+public:
+	ScopedLock(pthread_mutex_t* mutex)
+		: _mutex(mutex)
+	{
+		pthread_mutex_lock(_mutex);
+	}
+
+	~ScopedLock() {
+		pthread_mutex_unlock(_mutex);
+	}
+};
+
+/* Borrows a JIT for one scope, set up as 'config', or as the machine
+ * is now if that is NULL. */
+class JITLease {
+	JITMachine* _machine;
+	JIT* _jit;
+
+public:
+	JITLease(JITMachine* machine, const jit_settings* config = NULL)
+		: _machine(machine), _jit(machine->acquire(config))
+	{}
+
+	~JITLease() {
+		_machine->release(_jit);
+	}
+
+	JIT* get() { return _jit; }
+};
+
+/* A JIT is only ever used by one thread at a time; threads that
+ * find none idle make another. */
+JIT* JITMachine::acquire(const jit_settings* config) {
+	JIT* borrowed = NULL;
+	jit_settings wanted;
+	{
+		ScopedLock guard(&lock);
+		wanted = config ? *config : settings;
+		if (!idle.empty()) {
+			borrowed = idle.back();
+			idle.pop_back();
+		}
+	}
+	if (!borrowed) {
+		borrowed = new JIT(jit->lanes, defs);
+		ScopedLock guard(&lock);
+		jits.push_back(borrowed);
+	}
+	borrowed->configure(wanted);
+	return borrowed;
+}
+
+void JITMachine::release(JIT* borrowed) {
+	ScopedLock guard(&lock);
+	totals += borrowed->stats;
+	borrowed->stats = jit_stats();
+	reclaim(borrowed);
+	idle.push_back(borrowed);
+}
+
+/* Frees the code evicted while 'owner' was lent. Called with the
+ * machine's lock held, and 'owner' in no one's hands. */
+void JITMachine::reclaim(JIT* owner) {
+	map<JIT*, vector<Function*> >::iterator it = doomed.find(owner);
+	if (it == doomed.end()) {
+		return;
+	}
+	for (unsigned i=0; i < it->second.size(); ++i) {
+		owner->discard(it->second[i]);
+	}
+	doomed.erase(it);
+}
+
+/* Forgets released kernels, oldest first, until no more than the
+ * limit are resident. Called with the machine's lock held. */
+void JITMachine::evict() {
+	while (!released.empty() && kernel_infos.size() > kernel_limit) {
+		void* kernel = released.front();
+		released.pop_front();
+		kernel_info& info = kernel_infos[kernel];
+		kernels.erase(info.key);
+		if (info.fn) {
+			doomed[info.owner].push_back(info.fn);
+			if (find(idle.begin(), idle.end(), info.owner)
+				!= idle.end())
+			{
+				reclaim(info.owner);
+			}
+		}
+		kernel_infos.erase(kernel);
+	}
+}
+
+void JITMachine::retain_kernel(void* kernel) {
+	ScopedLock guard(&lock);
+	map<void*, kernel_info>::iterator it = kernel_infos.find(kernel);
+	if (it != kernel_infos.end() && it->second.refs++ == 0) {
+		released.erase(it->second.released);
+	}
+}
+
+void JITMachine::release_kernel(void* kernel) {
+	ScopedLock guard(&lock);
+	map<void*, kernel_info>::iterator it = kernel_infos.find(kernel);
+	if (it == kernel_infos.end() || !it->second.refs) {
+		return;
+	}
+	if (--it->second.refs == 0) {
+		it->second.released = released.insert(released.end(), kernel);
+		evict();
+	}
+}
+
+void JITMachine::set_kernel_limit(unsigned limit) {
+	ScopedLock guard(&lock);
+	kernel_limit = limit;
+	evict();
+}
+
+jit_memory JITMachine::memory() {
+	ScopedLock guard(&lock);
+	jit_memory mem;
+	mem.kernels = kernel_infos.size();
+	mem.referenced = kernel_infos.size() - released.size();
+	mem.jits = jits.size();
+	pthread_mutex_lock(&engine_lock);
+	for (unsigned i=0; i < jits.size(); ++i) {
+		mem.code_bytes += jits[i]->code_resident;
+	}
+	pthread_mutex_unlock(&engine_lock);
+	return mem;
+}
+
+void JITMachine::set_math_tier(math_tier_t tier) {
+	ScopedLock guard(&lock);
+	settings.math_tier = tier;
+}
+
+void JITMachine::set_fast_math(bool enable) {
+	ScopedLock guard(&lock);
+	settings.fast_math = enable;
+}
+
+void JITMachine::set_inline_threshold(unsigned threshold) {
+	ScopedLock guard(&lock);
+	settings.inline_threshold = threshold;
+}
+
+void JITMachine::set_input_range(string name, double lo, double hi) {
+	ScopedLock guard(&lock);
+	settings.ranges[name] = make_pair(lo, hi);
+}
+
+void JITMachine::set_tabulation(double max_error) {
+	ScopedLock guard(&lock);
+	settings.table_error = max_error;
+}
+
+void JITMachine::set_precision(precision_t precision) {
+	ScopedLock guard(&lock);
+	settings.precision = precision;
+}
+
+void JITMachine::set_tier_up_calls(unsigned calls) {
+	ScopedLock guard(&lock);
+	tier_up_calls = calls;
+}
+
+/* Covers every compile that has finished. */
+jit_stats JITMachine::stats() {
+	ScopedLock guard(&lock);
+	return totals;
+}
+
+void JITMachine::reset_stats() {
+	ScopedLock guard(&lock);
+	totals = jit_stats();
+}
+
+ASTNode* JITMachine::parse(JIT* jit, string expr, ASTArena& arena) {
+	double start = now_ms();
+	ASTNode* ast = Parser(expr, arena).parse();
+	if (ast) {
+		ast = arena.simplify(ast, jit);
+	}
+	jit->stats.parse_ms += now_ms() - start;
+	return ast;
+}
+
+/* Parses one output per expression, sharing subtrees between them. */
+ASTNode* JITMachine::parse(JIT* jit, vector<string> exprs,
+	ASTArena& arena)
+{
+	double start = now_ms();
+	ASTTuple* tuple = new (arena) ASTTuple();
+	Parser parser("", arena);
+	for (unsigned k=0; k < exprs.size(); ++k) {
+		parser.restart(exprs[k]);
+		ASTNode* ast = parser.parse();
+		if (!ast || dynamic_cast<ASTDef*>(ast) || !parser.atEnd()) {
+			tuple = NULL;
+			break;
+		}
+		tuple->elts.push_back(ast);
+	}
+	ASTNode* simple = (tuple && !exprs.empty())
+		? arena.simplify(tuple, jit) : NULL;
+	jit->stats.parse_ms += now_ms() - start;
+	return simple;
+}
+
+void JITMachine::set_cache_dir(string dir) {
+	ScopedLock guard(&lock);
+	if (!dir.empty()) {
+		mkdir(dir.c_str(), 0755);
+	}
+	cache_dir = dir;
+}
+
+string JITMachine::ast_key(ASTDef* defn) {
+	ASTKey key;
+	defn->canonical(key);
+
+	/* Calls to user definitions depend on those definitions. */
+	set<string>::iterator it = key.calls.begin();
+	for (; it != key.calls.end(); ++it) {
+		string def_key = defs->key(*it);
+		if (!def_key.empty()) {
+			key.text += " " + *it + "=" + def_key;
+		}
+	}
+	return key.text;
+}
+
+bool link_shared(const string& object, const string& library) {
+	/* Relative paths could otherwise pass for options. */
+	string obj = (object[0] == '/') ? object : "./" + object;
+	string lib = (library[0] == '/') ? library : "./" + library;
+	pid_t pid = fork();
+	if (pid < 0) {
+		return false;
+	} else if (pid == 0) {
+		execlp("cc", "cc", "-shared", "-o", lib.c_str(), obj.c_str(),
+			"-lm", (char*) NULL);
+		_exit(127);
+	}
+	int status;
+	while (waitpid(pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			return false;
+		}
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* The globals a value refers to, through any constant expressions. */
+static void collectGlobals(Value* val, vector<GlobalValue*>& globals) {
+	GlobalValue* global = dyn_cast<GlobalValue>(val);
+	Constant* constant = dyn_cast<Constant>(val);
+	if (global) {
+		globals.push_back(global);
+	} else if (constant) {
+		for (unsigned i=0; i < constant->getNumOperands(); ++i) {
+			collectGlobals(constant->getOperand(i), globals);
+		}
+	}
+}
+
+/* Copies 'fn', and the functions and tables it reaches, into a module
+ * of their own, rather than cloning every kernel 'mod' holds. */
+static Module* extractKernel(Module* mod, Function* fn) {
+	Module* copy = new Module(mod->getModuleIdentifier(),
+		mod->getContext());
+	copy->setDataLayout(mod->getDataLayout());
+	copy->setTargetTriple(mod->getTargetTriple());
+
+	ValueToValueMapTy vmap;
+	vector<Function*> bodies;
+	vector<GlobalValue*> work(1, fn);
+	while (!work.empty()) {
+		GlobalValue* global = work.back();
+		work.pop_back();
+		if (vmap.count(global)) {
+			continue;
+		}
+		GlobalVariable* var = dyn_cast<GlobalVariable>(global);
+		if (var) {
+			vmap[var] = new GlobalVariable(*copy,
+				var->getType()->getElementType(), var->isConstant(),
+				var->getLinkage(), var->getInitializer(),
+				var->getName());
+			continue;
+		}
+		Function* func = cast<Function>(global);
+		Function* dup = Function::Create(func->getFunctionType(),
+			func->getLinkage(), func->getName(), copy);
+		dup->copyAttributesFrom(func);
+		vmap[func] = dup;
+		if (func->isDeclaration()) {
+			continue;
+		}
+		bodies.push_back(func);
+		for (Function::iterator blk = func->begin(); blk != func->end();
+			++blk)
+		{
+			BasicBlock::iterator inst = blk->begin();
+			for (; inst != blk->end(); ++inst) {
+				for (unsigned i=0; i < inst->getNumOperands(); ++i) {
+					collectGlobals(inst->getOperand(i), work);
+				}
+			}
+		}
+	}
+
+	for (unsigned i=0; i < bodies.size(); ++i) {
+		Function* dup = cast<Function>(vmap[bodies[i]]);
+		Function::arg_iterator arg = bodies[i]->arg_begin();
+		Function::arg_iterator dest = dup->arg_begin();
+		for (; arg != bodies[i]->arg_end(); ++arg, ++dest) {
+			dest->setName(arg->getName());
+			vmap[arg] = dest;
+		}
+		SmallVector<ReturnInst*, 4> returns;
+		CloneFunctionInto(dup, bodies[i], vmap, false, returns);
+	}
+	return copy;
+}
+
+static string cache_file(string dir, const string& key, string ext) {
+	/* 64-bit FNV-1a */
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i=0; i < key.size(); ++i) {
+		hash ^= (unsigned char) key[i];
+		hash *= 1099511628211ULL;
+	}
+	return dir + "/" + utohexstr(hash) + ext;
+}
+
+void* JITMachine::cache_load(const string& key) {
+	string dir;
+	{
+		ScopedLock guard(&lock);
+		dir = cache_dir;
+	}
+	if (dir.empty()) {
+		return NULL;
+	}
+
+	/* The key file guards against hash collisions. */
+	ifstream keyfile(cache_file(dir, key, ".key").c_str(),
+		ios::binary);
+	string stored((istreambuf_iterator<char>(keyfile)),
+		istreambuf_iterator<char>());
+	if (stored != key) {
+		return NULL;
+	}
+
+	string lib = cache_file(dir, key, ".so");
+	void* handle = dlopen(lib.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (!handle) {
+		return NULL;
+	}
+	void* func = dlsym(handle, "kernel");
+	if (!func) {
+		dlclose(handle);
+		return NULL;
+	}
+	/* A library loaded before is the same handle, referenced again. */
+	ScopedLock guard(&lock);
+	if (find(libraries.begin(), libraries.end(), handle)
+		!= libraries.end())
+	{
+		dlclose(handle);
+	} else {
+		libraries.push_back(handle);
+	}
+	return func;
+}
+
+/* A kernel on its way into the cache: emitted to 'tmp'.o and .key,
+ * to be linked and renamed into place. */
+struct CacheLink {
+	string tmp, key, library;
+	bool failed;
+	JITMachine* machine;
+};
+
+void JITMachine::cache_store(JIT* jit, const string& key, Function* fn) {
+	string dir;
+	{
+		ScopedLock guard(&lock);
+		dir = cache_dir;
+	}
+	if (dir.empty()) {
+		return;
+	}
+
+	/* Keep 'fn' and whatever it calls, exporting only 'fn'. */
+	Module* copy = extractKernel(jit->mod, fn);
+	Module::iterator it = copy->begin();
+	for (; it != copy->end(); ++it) {
+		if (it->isDeclaration()) {
+			continue;
+		} else if (it->getName() == fn->getName()) {
+			it->setName("kernel");
+		} else {
+			it->setLinkage(GlobalValue::InternalLinkage);
+		}
+	}
+
+	/* Build under a name private to this process and JIT, then
+	 * publish with a rename. Emitting needs the JIT's context, but
+	 * linking runs 'cc', and is left to a thread of its own. */
+	CacheLink* link = new CacheLink();
+	link->tmp = cache_file(dir, key, "." + utostr(getpid()) + "."
+		+ utohexstr(uintptr_t(jit)) + "." + utostr(__sync_add_and_fetch(&cache_links, 1)));
+	link->key = cache_file(dir, key, ".key");
+	link->library = cache_file(dir, key, ".so");
+	bool ok = jit->emitObject(copy, link->tmp + ".o");
+	delete copy;
+	if (ok) {
+		ofstream keyfile((link->tmp + ".key").c_str(), ios::binary);
+		keyfile << key;
+		keyfile.close();
+		ok = keyfile.good();
+	}
+	link->failed = !ok;
+	link->machine = this;
+	{
+		ScopedLock guard(&lock);
+		++linking;
+	}
+	pthread_t linker;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (!ok || pthread_create(&linker, &attr, cache_linker, link) != 0) {
+		cache_linker(link);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/* Links and publishes a kernel cache_store emitted, or cleans up
+ * after one that failed. */
+void* JITMachine::cache_linker(void* arg) {
+	CacheLink* link = static_cast<CacheLink*>(arg);
+	string tmp = link->tmp;
+	if (!link->failed && link_shared(tmp + ".o", tmp + ".so")) {
+		rename((tmp + ".key").c_str(), link->key.c_str());
+		rename((tmp + ".so").c_str(), link->library.c_str());
+	}
+	unlink((tmp + ".o").c_str());
+	unlink((tmp + ".key").c_str());
+	unlink((tmp + ".so").c_str());
+
+	JITMachine* machine = link->machine;
+	delete link;
+	ScopedLock guard(&machine->lock);
+	if (--machine->linking == 0) {
+		pthread_cond_broadcast(&machine->linked);
+	}
+	return NULL;
+}
+
+void JITMachine::jit_internal(string expr) {
+	JITLease lease(this);
+	ASTArena arena;
+	ASTNode* ast = parse(lease.get(), expr, arena);
+	if (!ast) return;
+	jit_internal_ast(lease.get(), ast, expr);
+}
+
+/* Fails if the definition does not compile, or its name is bound to
+ * another body already. */
+bool JITMachine::jit_internal_ast(JIT* jit, ASTNode* ast,
+	const string& source)
+{
+	ASTDef* toplevel = dynamic_cast<ASTDef*>(ast);
+	if (!toplevel || typeid(toplevel) != typeid(ASTDef*)) {
+		return false;
+	}
+
+	/* Calls bind to the first definition of a name. Other JITs
+	 * compile it from the registry when they first call it. */
+	string key = ast_key(toplevel);
+	if (defs->source(toplevel->name).empty()) {
+		Value* fn = toplevel->codeGen(jit);
+		if (!fn) {
+			return false;
+		}
+		if (defs->add(toplevel->name, source, key)) {
+			return true;
+		}
+		/* Another thread defined the name first. */
+		static_cast<Function*>(fn)->eraseFromParent();
+	}
+	if (defs->key(toplevel->name) != key) {
+		cerr << toplevel->name << ": already defined" << endl;
+		return false;
+	}
+	return true;
+}
+
+void* JITMachine::jit_external(string defn) {
+	JITLease lease(this);
+	ASTArena arena;
+	ASTNode* ast = parse(lease.get(), defn, arena);
+	if (!ast) return NULL;
+	return jit_external_ast(lease.get(), ast, KERNEL_VECTOR);
+}
+
+void* JITMachine::jit_external_stream(string defn) {
+	JITLease lease(this);
+	ASTArena arena;
+	ASTNode* ast = parse(lease.get(), defn, arena);
+	if (!ast) return NULL;
+	return jit_external_ast(lease.get(), ast, KERNEL_STREAM);
+}
+
+Function* JITMachine::foreign_codegen(JIT* jit, ASTDef* defn,
+	kernel_t kind, const vector<stream_layout>& layouts)
+{
+	/* Tables stand in for functions in this kernel only. */
+	ASTArena tables;
+	ASTDef tabulated(defn->name);
+	if (jit->table_error > 0 && !jit->ranges.empty()) {
+		tabulated.params = defn->params;
+		tabulated.body = tabulate(jit, tables, defn->body);
+		defn = &tabulated;
+	}
+
+	Value* val;
+	if (kind == KERNEL_REDUCE) {
+		ASTReduceDef rdef(defn);
+		rdef.layouts = layouts;
+		val = rdef.codeGen(jit);
+	} else if (kind == KERNEL_STREAM) {
+		ASTStreamDef sdef(defn);
+		sdef.layouts = layouts;
+		val = sdef.codeGen(jit);
+	} else {
+		ASTForeignDef fdef(defn);
+		val = fdef.codeGen(jit);
+	}
+	return static_cast<Function*>(val);
+}
+
+/* Everything that tells one kernel's code from another's. */
+string JITMachine::kernel_key(JIT* jit, ASTDef* defn, kernel_t kind,
+	const vector<stream_layout>& layouts)
+{
+	static const char* prefix[] = { "external ", "stream ", "reduce " };
+	string key = prefix[kind] + jit->configKey();
+	for (unsigned i=0; i < layouts.size(); ++i) {
+		key += " l" + utostr(layouts[i].stride) + "."
+			+ utostr(layouts[i].offset);
+	}
+	return key + " " + ast_key(defn);
+}
+
+/* A kernel compiled before, with another reference, or NULL. */
+void* JITMachine::find_kernel(const string& key) {
+	ScopedLock guard(&lock);
+	if (!kernels.count(key)) {
+		return NULL;
+	}
+	void* func = kernels[key];
+	retain_kernel(func);
+	return func;
+}
+
+/* Publishes a kernel 'jit' emitted as 'fn', or loaded from the cache
+ * if that is NULL, with one reference. */
+void* JITMachine::add_kernel(JIT* jit, const string& key, void* func,
+	Function* fn, ASTDef* defn, kernel_t kind,
+	const vector<stream_layout>& layouts)
+{
+	/* Two threads may compile the same kernel; the first to finish
+	 * wins, and the other's code goes once its JIT is returned. */
+	ScopedLock guard(&lock);
+	if (kernels.count(key)) {
+		if (fn) {
+			doomed[jit].push_back(fn);
+		}
+		func = kernels[key];
+		retain_kernel(func);
+		return func;
+	}
+	kernels[key] = func;
+
+	/* Remember how the kernel's arrays are laid out and, for
+	 * reductions, how partial results combine. */
+	kernel_info& info = kernel_infos[func];
+	info.precision = jit->precision;
+	info.reduces = (kind == KERNEL_REDUCE);
+	info.op = REDUCE_SUM;
+	reduceOp(defn->body, info.op);
+	info.strides.clear();
+	for (unsigned i=0; i < layouts.size(); ++i) {
+		info.strides.push_back(layouts[i].stride);
+	}
+	info.key = key;
+	info.refs = 1;
+	info.owner = fn ? jit : NULL;
+	info.fn = fn;
+	return func;
+}
+
+void* JITMachine::jit_foreign(JIT* jit, ASTDef* defn, kernel_t kind,
+	const vector<stream_layout>& layouts)
+{
+	string key = kernel_key(jit, defn, kind, layouts);
+	void* func = find_kernel(key);
+	if (func) {
+		return func;
+	}
+
+	Function* fn = NULL;
+	func = cache_load(key);
+	if (!func) {
+		fn = foreign_codegen(jit, defn, kind, layouts);
+		if (!fn) {
+			return NULL;
+		}
+		jit->finalize(fn);
+		func = jit->emit(fn);
+		if (!func) {
+			return NULL;
+		}
+		cache_store(jit, key, fn);
+	}
+	return add_kernel(jit, key, func, fn, defn, kind, layouts);
+}
+
+void* JITMachine::jit_external_ast(JIT* jit, ASTNode* ast, kernel_t kind) {
 	void* func = NULL;
-	ASTForeignDef wrapper("externalexpr");
+	ASTDef* toplevel = dynamic_cast<ASTDef*>(ast);
+	if (toplevel && typeid(toplevel) == typeid(ASTDef*)) {
+		func = jit_foreign(jit, toplevel, kind, vector<stream_layout>());
+	}
+	return func;
+}
+
+void* JITMachine::jit_external_expr(string expr, vector<string> params) {
+	JITLease lease(this);
+	ASTArena arena;
+	ASTNode* ast = parse(lease.get(), expr, arena);
+	if (!ast) return NULL;
+	return jit_external_expr_ast(lease.get(), ast, params, KERNEL_VECTOR);
+}
+
+void* JITMachine::jit_external_stream_expr(string expr,
+	vector<string> params)
+{
+	JITLease lease(this);
+	ASTArena arena;
+	ASTNode* ast = parse(lease.get(), expr, arena);
+	if (!ast) return NULL;
+	return jit_external_expr_ast(lease.get(), ast, params, KERNEL_STREAM);
+}
+
+void* JITMachine::jit_external_exprs(vector<string> exprs,
+	vector<string> params)
+{
+	JITLease lease(this);
+	ASTArena arena;
+	ASTNode* ast = parse(lease.get(), exprs, arena);
+	if (!ast) return NULL;
+	return jit_external_expr_ast(lease.get(), ast, params, KERNEL_VECTOR);
+}
+
+void* JITMachine::jit_external_stream_exprs(vector<string> exprs,
+	vector<string> params)
+{
+	JITLease lease(this);
+	ASTArena arena;
+	ASTNode* ast = parse(lease.get(), exprs, arena);
+	if (!ast) return NULL;
+	return jit_external_expr_ast(lease.get(), ast, params, KERNEL_STREAM);
+}
+
+void* JITMachine::jit_reduce_expr(string expr, vector<string> params) {
+	JITLease lease(this);
+	ASTArena arena;
+	ASTNode* ast = parse(lease.get(), expr, arena);
+	reduce_t op;
+	if (!ast || !reduceOp(ast, op)) return NULL;
+	return jit_external_expr_ast(lease.get(), ast, params, KERNEL_REDUCE);
+}
+
+void* JITMachine::jit_gradient(string defn, vector<string> wrt) {
+	JITLease lease(this);
+	JIT* jit = lease.get();
+	ASTArena arena;
+	ASTNode* ast = parse(jit, defn, arena);
+	ASTDef* toplevel = ast ? dynamic_cast<ASTDef*>(ast) : NULL;
+	if (!toplevel || dynamic_cast<ASTTuple*>(toplevel->body)) return NULL;
+	if (wrt.empty()) {
+		wrt = toplevel->params;
+	}
+
+	Differentiator diff(jit, arena);
+	ASTTuple* tuple = new (arena) ASTTuple();
+	ASTNode* value = diff.expand(toplevel);
+	tuple->elts.push_back(value);
+	for (unsigned i=0; i < wrt.size(); ++i) {
+		if (find(toplevel->params.begin(), toplevel->params.end(),
+			wrt[i]) == toplevel->params.end())
+		{
+			return NULL;
+		}
+		tuple->elts.push_back(diff.tangent(value, wrt[i]));
+	}
+	if (diff.failed()) return NULL;
+	return jit_external_expr_ast(jit, arena.simplify(tuple, jit),
+		toplevel->params, KERNEL_STREAM);
+}
+
+void* JITMachine::jit_strided_exprs(vector<string> exprs,
+	vector<string> params, vector<stream_layout> layouts)
+{
+	JITLease lease(this);
+	ASTArena arena;
+	ASTNode* ast = parse(lease.get(), exprs, arena);
+	if (!ast) return NULL;
+	return jit_external_expr_ast(lease.get(), ast, params, KERNEL_STREAM,
+		layouts);
+}
+
+void* JITMachine::jit_strided_reduce_expr(string expr,
+	vector<string> params, vector<stream_layout> layouts)
+{
+	JITLease lease(this);
+	ASTArena arena;
+	ASTNode* ast = parse(lease.get(), expr, arena);
+	reduce_t op;
+	if (!ast || !reduceOp(ast, op)) return NULL;
+	return jit_external_expr_ast(lease.get(), ast, params, KERNEL_REDUCE,
+		layouts);
+}
+
+void* JITMachine::jit_external_expr_ast(JIT* jit, ASTNode* ast,
+	vector<string> params, kernel_t kind,
+	const vector<stream_layout>& layouts)
+{
+	ASTDef wrapper("externalexpr");
 	wrapper.body = ast;
 	wrapper.params = params;
-	Value* val = wrapper.codeGen(jit);
-	if (!val) {
-		goto done;
-	} else {
-		Function* fn = static_cast<Function*>(val);
-		func = jit->jit->getPointerToFunction(fn);
-	}	
+	void* func = jit_foreign(jit, &wrapper, kind, layouts);
+	return func;
+}
+
+/* Chunks sized so that all of a chunk's streams fit in L2 together. */
+static const size_t chunk_bytes = 1 << 18;
+
+/* Arrays hold elements of the kernel's storage type, which need not be
+ * float; step through them by bytes. */
+static const float* advance(const float* array, size_t elts,
+	unsigned elt_bytes)
+{
+	return (const float*)((const char*)array + elts * elt_bytes);
+}
+
+static float* advance(float* array, size_t elts, unsigned elt_bytes) {
+	return (float*)((char*)array + elts * elt_bytes);
+}
+
+/* Elements between consecutive records of each stream. */
+static vector<unsigned> streamStrides(const vector<unsigned>& strides,
+	size_t streams)
+{
+	vector<unsigned> all(strides.begin(), strides.end());
+	all.resize(max(all.size(), streams), 1);
+	return all;
+}
+
+/* Whole vectors per chunk, so only the last one has a tail. */
+static size_t chunkLength(const vector<unsigned>& strides,
+	unsigned elt_bytes, unsigned lanes)
+{
+	size_t row = 0;
+	for (unsigned i=0; i < strides.size(); ++i) {
+		row += strides[i];
+	}
+	size_t chunk = chunk_bytes / (max(row, size_t(1)) * elt_bytes);
+	chunk -= chunk % lanes;
+	return (chunk < lanes) ? lanes : chunk;
+}
+
+struct BatchTask : public PoolTask {
+	stream_trampoline trampoline;
+	void* kernel;
+	vector<const float*> inputs;
+	vector<float*> results;
+	size_t count;
+	size_t chunk;
+	unsigned elt_bytes;
+	vector<unsigned> strides;	/* per input, then result */
+
+	virtual void runChunk(size_t index) {
+		size_t begin = index * chunk;
+		size_t len = min(chunk, count - begin);
+		vector<const float*> ins(inputs);
+		vector<float*> outs(results);
+		for (unsigned i=0; i < ins.size(); ++i) {
+			ins[i] = advance(ins[i], begin * strides[i], elt_bytes);
+		}
+		for (unsigned i=0; i < outs.size(); ++i) {
+			outs[i] = advance(outs[i], begin * strides[ins.size() + i],
+				elt_bytes);
+		}
+		trampoline(kernel, ins.empty() ? NULL : &ins[0],
+			&outs[0], len);
+	}
+};
 
-done:
-	delete ast;
+void JITMachine::run_batch(void* kernel, vector<const float*> inputs,
+	float* result, size_t n)
+{
+	run_batch(kernel, inputs, vector<float*>(1, result), n);
+}
+
+/* Trampolines are shared by every kernel of the same shape. */
+stream_trampoline JITMachine::trampoline(unsigned nins, unsigned nouts,
+	precision_t precision)
+{
+	pair<precision_t, pair<unsigned, unsigned> > key(precision,
+		make_pair(nins, nouts));
+	{
+		ScopedLock guard(&lock);
+		if (trampolines.count(key)) {
+			return trampolines[key];
+		}
+	}
+	JITLease lease(this);
+	stream_trampoline func = lease.get()->streamTrampoline(nins, nouts,
+		precision);
+	ScopedLock guard(&lock);
+	trampolines[key] = func;
 	return func;
 }
 
+/* Runs without the machine's lock, given the kernel's trampoline. */
+static void runStream(JITMachine* machine, stream_trampoline trampoline,
+	void* kernel, precision_t prec, const vector<unsigned>& strides,
+	const vector<const float*>& inputs, const vector<float*>& results,
+	size_t n)
+{
+	BatchTask task;
+	task.trampoline = trampoline;
+	task.kernel = kernel;
+	task.inputs = inputs;
+	task.results = results;
+	task.count = n;
+	task.elt_bytes = storageBytes(prec);
+	task.strides = streamStrides(strides, inputs.size() + results.size());
+	task.chunk = chunkLength(task.strides, task.elt_bytes,
+		machine->jit->lanes);
+
+	{
+		ScopedLock guard(&machine->lock);
+		if (!machine->pool) {
+			machine->pool = new ThreadPool();
+		}
+	}
+	machine->pool->run(&task, (n + task.chunk - 1) / task.chunk);
+}
+
+void JITMachine::run_batch(void* kernel, vector<const float*> inputs,
+	vector<float*> results, size_t n)
+{
+	if (!kernel || !n || results.empty()) return;
+
+	precision_t prec = PRECISION_F32;
+	vector<unsigned> strides;
+	{
+		ScopedLock guard(&lock);
+		if (kernel_infos.count(kernel)) {
+			prec = kernel_infos[kernel].precision;
+			strides = kernel_infos[kernel].strides;
+		}
+	}
+	runStream(this, trampoline(inputs.size(), results.size(), prec),
+		kernel, prec, strides, inputs, results, n);
+}
+
+/* Each chunk reduces to one partial result, combined here. */
+struct ReduceTask : public PoolTask {
+	stream_trampoline trampoline;
+	void* kernel;
+	vector<const float*> inputs;
+	size_t count;
+	size_t chunk;
+	unsigned elt_bytes;
+	vector<unsigned> strides;
+	vector<double> partials;
+
+	virtual void runChunk(size_t index) {
+		size_t begin = index * chunk;
+		size_t len = min(chunk, count - begin);
+		vector<const float*> ins(inputs);
+		for (unsigned i=0; i < ins.size(); ++i) {
+			ins[i] = advance(ins[i], begin * strides[i], elt_bytes);
+		}
+		float* out = (float*) &partials[index];
+		trampoline(kernel, ins.empty() ? NULL : &ins[0], &out, len);
+	}
+};
+
+/* Partial results combine in double, so an F64 kernel's precision
+ * survives, and an F32 kernel's loses nothing more. */
+double JITMachine::run_reduce(void* kernel, vector<const float*> inputs,
+	size_t n)
+{
+	kernel_info info;
+	{
+		ScopedLock guard(&lock);
+		if (!kernel || !kernel_infos.count(kernel)) return NAN;
+		info = kernel_infos[kernel];
+	}
+	if (!info.reduces) return NAN;
+	reduce_t op = info.op;
+
+	ReduceTask task;
+	task.trampoline = trampoline(inputs.size(), 0, info.precision);
+	task.kernel = kernel;
+	task.inputs = inputs;
+	task.count = n;
+	task.elt_bytes = storageBytes(info.precision);
+	task.strides = streamStrides(info.strides, inputs.size());
+	task.chunk = chunkLength(task.strides, task.elt_bytes, jit->lanes);
+
+	/* An empty range still runs once, for the kernel's own answer. */
+	size_t chunks = max((n + task.chunk - 1) / task.chunk, size_t(1));
+	task.partials.resize(chunks);
+	{
+		ScopedLock guard(&lock);
+		if (!pool) {
+			pool = new ThreadPool();
+		}
+	}
+	pool->run(&task, chunks);
+
+	double total = task.partials[0];
+	if (op == REDUCE_MEAN) {
+		total *= min(task.chunk, n);
+	}
+	for (size_t c=1; c < chunks; ++c) {
+		double part = task.partials[c];
+		if (op == REDUCE_MIN) {
+			total = (part < total) ? part : total;
+		} else if (op == REDUCE_MAX) {
+			total = (part > total) ? part : total;
+		} else if (op == REDUCE_MEAN) {
+			total += part * min(task.chunk, n - c * task.chunk);
+		} else {
+			total += part;
+		}
+	}
+	return (op == REDUCE_MEAN) ? total / n : total;
+}
+
+TieredKernel* JITMachine::jit_tiered_exprs(vector<string> exprs,
+	vector<string> params)
+{
+	jit_settings config;
+	{
+		ScopedLock guard(&lock);
+		config = settings;
+	}
+	TieredKernel* kernel = new TieredKernel(this, config);
+	kernel->exprs = exprs;
+	kernel->params = params;
+
+	/* The lease is given back before compiling, which takes its own. */
+	bool interpreted;
+	{
+		JITLease lease(this);
+		JIT* jit = lease.get();
+		ASTNode* ast = parse(jit, exprs, kernel->arena);
+		ASTTuple* tuple = dynamic_cast<ASTTuple*>(ast);
+		if (tuple) {
+			kernel->outs.assign(tuple->elts.begin(), tuple->elts.end());
+		} else if (ast) {
+			kernel->outs.push_back(ast);
+		}
+
+		if (!ast) {
+			delete kernel;
+			return NULL;
+		}
+		interpreted = config.precision != PRECISION_F16
+			&& kernel->interp.prepare(jit, kernel->outs);
+	}
+
+	/* What the interpreter cannot run is compiled before returning. */
+	if (!interpreted) {
+		kernel->tier = 2;
+		tier_compiler(kernel);
+		if (!kernel->native) {
+			delete kernel;
+			return NULL;
+		}
+		return kernel;
+	}
+	start_tier(kernel, 1);
+	return kernel;
+}
+
+/* Compiles in the background, or right away if no thread starts. */
+void JITMachine::start_tier(TieredKernel* kernel, unsigned tier) {
+	kernel->tier = tier;
+	kernel->compiling = (pthread_create(&kernel->compiler, NULL,
+		tier_compiler, kernel) == 0);
+	if (!kernel->compiling) {
+		tier_compiler(kernel);
+	}
+}
+
+void* JITMachine::tier_compiler(void* arg) {
+	TieredKernel* kernel = static_cast<TieredKernel*>(arg);
+	JITMachine* machine = kernel->machine;
+
+	/* Compile as the kernel was defined, whatever the caller has
+	 * changed since. */
+	jit_settings config = kernel->settings;
+	config.quick = (kernel->tier == 1);
+	JITLease lease(machine, &config);
+	ASTArena arena;
+	ASTNode* ast = machine->parse(lease.get(), kernel->exprs, arena);
+	void* native = ast ? machine->jit_external_expr_ast(lease.get(), ast,
+		kernel->params, KERNEL_STREAM) : NULL;
+	if (native) {
+		kernel->trampoline = machine->trampoline(kernel->params.size(),
+			kernel->outs.size(), config.precision);
+		__sync_synchronize();
+		kernel->native = native;
+	}
+	return NULL;
+}
+
+void JITMachine::run_tiered(TieredKernel* kernel,
+	vector<const float*> inputs, vector<float*> results, size_t n)
+{
+	if (!kernel || !n || inputs.size() != kernel->params.size()
+		|| results.size() != kernel->outs.size())
+	{
+		return;
+	}
+
+	/* Code a later tier replaced is no longer needed. */
+	void* native = kernel->native;
+	if (native != kernel->current) {
+		if (kernel->current) {
+			release_kernel(kernel->current);
+		}
+		kernel->current = native;
+	}
+	if (!native) {
+		kernel->interp.run(kernel->outs, kernel->params,
+			inputs.empty() ? NULL : &inputs[0], &results[0], n);
+	} else {
+		__sync_synchronize();
+		runStream(this, kernel->trampoline, native,
+			kernel->settings.precision,
+			vector<unsigned>(), inputs, results, n);
+	}
+
+	/* Hot kernels move up once their quick code is in place. */
+	unsigned threshold;
+	{
+		ScopedLock guard(&lock);
+		threshold = tier_up_calls;
+	}
+	if (++kernel->calls >= threshold && threshold
+		&& kernel->tier == 1 && native)
+	{
+		if (kernel->compiling) {
+			pthread_join(kernel->compiler, NULL);
+		}
+		start_tier(kernel, 2);
+	}
+}
+
+void JITMachine::free_tiered(TieredKernel* kernel) {
+	if (!kernel) {
+		return;
+	}
+	if (kernel->compiling) {
+		pthread_join(kernel->compiler, NULL);
+	}
+	if (kernel->current && kernel->current != kernel->native) {
+		release_kernel(kernel->current);
+	}
+	if (kernel->native) {
+		release_kernel(kernel->native);
+	}
+	delete kernel;
+}
+
 void* JITMachine::jit_repl_expr(string expr) {
-	ASTNode* ast = Parser(expr).parse();
+	JITLease lease(this);
+	ASTArena arena;
+	ASTNode* ast = parse(lease.get(), expr, arena);
+	if (!ast) return NULL;
 	ASTDef* toplevel = dynamic_cast<ASTDef*>(ast);
 	if (toplevel && typeid(toplevel) == typeid(ASTDef*)) {
-		jit_internal_ast(toplevel);
+		jit_internal_ast(lease.get(), toplevel, expr);
 		return NULL;
 	} else {
 		vector<string> params;
-		return jit_external_expr_ast(ast, params);
+		return jit_external_expr_ast(lease.get(), ast, params,
+			KERNEL_VECTOR);
+	}
+}
+
+vector<string> split_forms(const string& source) {
+	vector<string> forms;
+	string form;
+	int opened = 0;
+	for (size_t i=0; i < source.size(); ++i) {
+		char cur = source[i];
+		if (opened == 0 && cur != '(') {
+			continue;
+		}
+		form += cur;
+		if (cur == '(') {
+			++opened;
+		} else if (cur == ')' && --opened == 0) {
+			forms.push_back(form);
+			form.clear();
+		}
+	}
+	return forms;
+}
+
+map<string, void*> JITMachine::compile_batch(vector<string> sources) {
+	JITLease lease(this);
+	JIT* jit = lease.get();
+	ASTArena arena;
+	map<string, void*> table;
+	vector<stream_layout> dense;
+
+	/* Kernels generated but not yet emitted. */
+	vector<string> names, keys;
+	vector<ASTDef*> defns;
+	vector<kernel_t> kinds;
+	vector<Function*> fns;
+	for (unsigned i=0; i < sources.size(); ++i) {
+		ASTNode* ast = parse(jit, sources[i], arena);
+		if (!ast) continue;
+		ASTDef* defn = dynamic_cast<ASTDef*>(ast);
+		string name = defn ? defn->name : sources[i];
+		if (table.count(name)
+			|| find(names.begin(), names.end(), name) != names.end())
+		{
+			continue;
+		}
+
+		kernel_t kind = KERNEL_VECTOR;
+		reduce_t op;
+		if (defn) {
+			if (!jit_internal_ast(jit, defn, sources[i])) {
+				continue;
+			}
+			kind = reduceOp(defn->body, op) ? KERNEL_REDUCE
+				: KERNEL_STREAM;
+		} else {
+			defn = new (arena) ASTDef("externalexpr");
+			defn->body = ast;
+		}
+
+		string key = kernel_key(jit, defn, kind, dense);
+		void* func = find_kernel(key);
+		if (!func && (func = cache_load(key))) {
+			func = add_kernel(jit, key, func, NULL, defn, kind, dense);
+		}
+		if (func) {
+			table[name] = func;
+			continue;
+		}
+		Function* fn = foreign_codegen(jit, defn, kind, dense);
+		if (fn) {
+			names.push_back(name);
+			keys.push_back(key);
+			defns.push_back(defn);
+			kinds.push_back(kind);
+			fns.push_back(fn);
+		}
+	}
+
+	jit->finalize(fns);
+	vector<void*> code = jit->emit(fns);
+	for (unsigned i=0; i < fns.size(); ++i) {
+		if (!code[i]) continue;
+		cache_store(jit, keys[i], fns[i]);
+		table[names[i]] = add_kernel(jit, keys[i], code[i], fns[i],
+			defns[i], kinds[i], dense);
+	}
+	return table;
+}
+
+map<string, void*> JITMachine::load_file(string path) {
+	ifstream in(path.c_str());
+	string source((istreambuf_iterator<char>(in)),
+		istreambuf_iterator<char>());
+	return compile_batch(split_forms(source));
+}
+
+/* Names usable in C; anything else becomes an underscore. */
+static string cIdent(StringRef name) {
+	string ident = name.str();
+	for (size_t i=0; i < ident.size(); ++i) {
+		if (!isalnum(ident[i])) {
+			ident[i] = '_';
+		}
+	}
+	if (ident.empty() || isdigit(ident[0])) {
+		ident = "_" + ident;
+	}
+	return ident;
+}
+
+/* How C sees a kernel compiled from 'defn'. */
+static string cDecl(const string& name, ASTDef* defn, bool stream,
+	bool reduces, precision_t prec)
+{
+	string elt = (prec == PRECISION_F64) ? "double"
+		: (prec == PRECISION_F16) ? "uint16_t" : "float";
+	ASTTuple* tuple = dynamic_cast<ASTTuple*>(defn->body);
+	unsigned nouts = reduces ? 0 : tuple ? tuple->elts.size() : 1;
+
+	vector<string> args;
+	for (unsigned i=0; i < defn->params.size(); ++i) {
+		args.push_back("const " + elt + "* " + cIdent(defn->params[i]));
+	}
+	for (unsigned k=0; k < nouts; ++k) {
+		args.push_back(elt + "* out" + (nouts > 1 ? utostr(k) : ""));
+	}
+	if (stream) {
+		args.push_back("size_t n");
+	}
+
+	string decl = !reduces ? "void "
+		: (prec == PRECISION_F64) ? "double " : "float ";
+	decl += name + "(";
+	for (unsigned i=0; i < args.size(); ++i) {
+		decl += (i ? ", " : "") + args[i];
+	}
+	return decl + (args.empty() ? "void);" : ");");
+}
+
+bool JITMachine::jit_object(vector<string> defns, string path,
+	bool vectors, vector<string>& decls)
+{
+	JITLease lease(this);
+	JIT* jit = lease.get();
+	ASTArena arena;
+	vector<Function*> fns;
+	vector<string> names;
+	bool ok = true;
+	for (unsigned i=0; ok && i < defns.size(); ++i) {
+		ASTNode* ast = parse(jit, defns[i], arena);
+		ASTDef* defn = ast ? dynamic_cast<ASTDef*>(ast) : NULL;
+		if (!defn) {
+			ok = false;
+			break;
+		}
+
+		/* Later definitions may call this one. */
+		if (!jit_internal_ast(jit, defn, defns[i])) {
+			ok = false;
+			break;
+		}
+
+		reduce_t op;
+		kernel_t kind = vectors ? KERNEL_VECTOR
+			: reduceOp(defn->body, op) ? KERNEL_REDUCE : KERNEL_STREAM;
+		Function* fn = foreign_codegen(jit, defn, kind,
+			vector<stream_layout>());
+		if (!fn) {
+			ok = false;
+			break;
+		}
+		jit->finalize(fn);
+		fns.push_back(fn);
+		names.push_back(cIdent(defn->name));
+		decls.push_back(cDecl(names.back(), defn, !vectors,
+			kind == KERNEL_REDUCE, jit->precision));
+	}
+
+	if (ok) {
+		/* Only the kernels are exported; what they call, and
+		 * whatever else the module holds, is private or dropped. */
+		ValueToValueMapTy vmap;
+		Module* copy = CloneModule(jit->mod, vmap);
+		Module::iterator it = copy->begin();
+		for (; it != copy->end(); ++it) {
+			if (!it->isDeclaration()) {
+				it->setLinkage(GlobalValue::InternalLinkage);
+				it->setName("expr." + it->getName().str());
+			}
+		}
+		for (unsigned i=0; i < fns.size(); ++i) {
+			Function* fn = cast<Function>(vmap[fns[i]]);
+			fn->setLinkage(GlobalValue::ExternalLinkage);
+			fn->setName(names[i]);
+			ok = ok && fn->getName() == names[i];
+		}
+		PassManager cleanup;
+		cleanup.add(createGlobalDCEPass());
+		cleanup.run(*copy);
+		ok = ok && jit->emitObject(copy, path);
+		delete copy;
+	}
+
+	/* The kernels were never meant for this process. */
+	for (unsigned i=0; i < fns.size(); ++i) {
+		fns[i]->eraseFromParent();
 	}
+	return ok;
 }
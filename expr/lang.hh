@@ -6,12 +6,24 @@
 
 #include <map>
 #include <set>
-#include <list>
 #include <string>
 #include <typeinfo>
 #include <cstdlib>
+#include <cmath>
+#include <cfloat>
 #include <ctype.h>
 #include <iostream>
+#include <fstream>
+#include <iterator>
+#include <dlfcn.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#endif
 
 #include <llvm/LLVMContext.h>
 #include <llvm/Module.h>
@@ -31,9 +43,27 @@
 #include <llvm/Transforms/Scalar.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
 #include <llvm/ExecutionEngine/JIT.h>
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/DataLayout.h>
+#include <llvm/Support/FormattedStream.h>
+#include <llvm/Support/MathExtras.h>
 #include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/Host.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/STLExtras.h>
+#include <llvm/Support/Allocator.h>
 
 #include "jit.hh"
+#include "pool.hh"
 
 using namespace llvm;
 
@@ -44,27 +74,72 @@ enum token_t {
 	TOK_IDENT,
 };
 
+/* Tokens are views into the source, which must outlive the lexer. */
 class Lexer {
+	StringRef _buf;
 	size_t _pos;
-	string _buf;
-	string _lastToken;
-	list<token_t> _tok_q;
+	StringRef _lastToken;
+	token_t _pushed;
+	bool _has_pushed;
 
 public:
-	Lexer(string buf)
-		: _pos(0), _buf(buf)
+	Lexer(StringRef buf)
+		: _buf(buf), _pos(0), _has_pushed(false)
 	{}
 
 	token_t getToken();
-	string getTokenString();
+	StringRef getTokenString();
 	void putToken(token_t tok);
 };
 
 struct JIT;
+struct ASTNode;
+class Interpreter;
+
+/* Owns the nodes and identifiers of one compilation, and releases
+ * them all at once. */
+class ASTArena {
+	BumpPtrAllocator _alloc;
+	vector<ASTNode*> _nodes;
+	StringSet<> _idents;
+	DenseMap<ASTNode*, ASTNode*> _simple;
+
+public:
+	~ASTArena();
+	void* allocate(size_t size);
+	StringRef intern(StringRef ident);
+
+	/* Simplifies each node once, however many parents share it. */
+	ASTNode* simplify(ASTNode* node, JIT* jit);
+};
+
+/* Structural key of an AST, with parameters named by position. */
+struct ASTKey {
+	vector<string> params;
+	set<string> calls;
+	map<ASTNode*, unsigned> shared;
+	string text;
+};
 
 struct ASTNode {
 	virtual ~ASTNode() {};
 	virtual Value* codeGen(JIT* jit) = 0;
+	virtual void canonical(ASTKey& key) = 0;
+
+	/* Returns an equivalent node, or 'this'. Nodes may be shared,
+	 * so only 'this' may be changed in place. */
+	virtual ASTNode* simplify(JIT*, ASTArena&) { return this; }
+
+	/* The node's values over the interpreter's current block, or
+	 * NULL for nodes that only code generation understands. */
+	virtual const double* evaluate(Interpreter&) { return NULL; }
+
+	/* Nodes only come from an arena, which destroys them. */
+	void* operator new(size_t size, ASTArena& arena) {
+		return arena.allocate(size);
+	}
+	void operator delete(void*, ASTArena&) {}
+	void operator delete(void*) {}
 };
 
 struct ASTDef : public ASTNode {
@@ -73,79 +148,377 @@ struct ASTDef : public ASTNode {
 	ASTNode* body;
 
 	ASTDef(string _name)
-		: name(_name)
+		: name(_name), body(NULL)
 	{}
 
 	bool validateArgs();
 	virtual Value* codeGen(JIT* jit);
+	virtual void canonical(ASTKey& key);
+	virtual ASTNode* simplify(JIT* jit, ASTArena& arena);
 };
 
 struct ASTForeignDef : public ASTDef {
+	/* Per parameter, then per result; missing ones are dense. */
+	vector<stream_layout> layouts;
+
 	ASTForeignDef(string _name)
 		: ASTDef(_name)
 	{}
 
 	ASTForeignDef(ASTDef* def);
+	vector<ASTNode*> outputs();
+	bool validateLayouts(unsigned nouts);
+	virtual Value* codeGen(JIT* jit);
+};
+
+struct ASTStreamDef : public ASTForeignDef {
+	ASTStreamDef(string _name)
+		: ASTForeignDef(_name)
+	{}
+
+	ASTStreamDef(ASTDef* def)
+		: ASTForeignDef(def)
+	{}
+
+	virtual Value* codeGen(JIT* jit);
+};
+
+/* Reduces every element of its input streams to one float. The body
+ * is the reduction, e.g. (sum e) or (dot a b). */
+struct ASTReduceDef : public ASTForeignDef {
+	reduce_t op;
+
+	ASTReduceDef(ASTDef* def);
+	Value* element(JIT* jit);
+	virtual Value* codeGen(JIT* jit);
+};
+
+bool reduceOp(ASTNode* body, reduce_t& op);
+
+/* The results of a multi-output kernel, in order. */
+struct ASTTuple : public ASTNode {
+	SmallVector<ASTNode*, 4> elts;
+
 	virtual Value* codeGen(JIT* jit);
+	virtual void canonical(ASTKey& key);
+	virtual ASTNode* simplify(JIT* jit, ASTArena& arena);
 };
 
+/* Names are interned in the arena, or string literals. */
 struct ASTCall : public ASTNode {
-	string name;
-	list<ASTNode*> args;
+	typedef SmallVector<ASTNode*, 4> arg_list;
+
+	StringRef name;
+	arg_list args;
 
-	ASTCall(string _name)
+	ASTCall(StringRef _name)
 		: name(_name)
 	{}
 
-	~ASTCall();
+	ASTNode* takeFront();
 	virtual Value* codeGen(JIT* jit);
+	virtual void canonical(ASTKey& key);
+	virtual ASTNode* simplify(JIT* jit, ASTArena& arena);
+	virtual const double* evaluate(Interpreter& in);
 };
 
 struct ASTVar : public ASTNode {
-	string ident;
+	StringRef ident;
 
-	ASTVar(string _ident)
+	ASTVar(StringRef _ident)
 		: ident(_ident)
 	{}
 
 	virtual Value* codeGen(JIT* jit);
+	virtual void canonical(ASTKey& key);
+	virtual const double* evaluate(Interpreter& in);
 };
 
 struct ASTNumber : public ASTNode {
-	float num;
+	double num;
 
-	ASTNumber(float _num)
+	ASTNumber(double _num)
 		: num(_num)
 	{}
 
 	virtual Value* codeGen(JIT* jit);
+	virtual void canonical(ASTKey& key);
+	virtual const double* evaluate(Interpreter& in);
+};
+
+/* A function of one parameter, interpolated linearly between
+ * 'values' spaced evenly over [lo, hi]. table.cc */
+struct ASTTable : public ASTNode {
+	ASTVar* arg;
+	double lo, hi;
+	vector<double> values;
+	GlobalVariable* global;		/* shared by the loop and the tail */
+
+	ASTTable(ASTVar* _arg, double _lo, double _hi)
+		: arg(_arg), lo(_lo), hi(_hi), global(NULL)
+	{}
+
+	virtual Value* codeGen(JIT* jit);
+	virtual void canonical(ASTKey& key);
+
+private:
+	GlobalVariable* newTable(JIT* jit);
 };
 
+/* Parses into a DAG: identical subtrees and let-bound names all
+ * refer to a single node. */
 class Parser {
 	Lexer _lex;
+	ASTArena& _arena;
+	StringMap<ASTNode*> _shared;
+	vector<pair<StringRef, ASTNode*> > _bindings;
+
+	ASTNode* share(StringRef key, ASTNode* node);
+	ASTNode* shareVar(StringRef ident);
 
 public:
-	Parser(string expr);
+	Parser(StringRef expr, ASTArena& arena);
+	void restart(StringRef expr);
+	bool atEnd();
 	~Parser() {};
 	ASTNode* parse();
 };
 
+/* A builtin function, emitted from its generated arguments and
+ * folded from constant ones. A max_args of 0 means no limit; those
+ * that round between operands fold a 'step' at a time. */
+struct Builtin {
+	const char* name;
+	unsigned min_args;
+	unsigned max_args;
+	Value* (*emit)(JIT* jit, ASTCall* call, vector<Value*>& vals);
+	double (*fold)(const vector<double>& nums);
+	double (*step)(double a, double b);
+};
+
+/* The builtin's value over constants, in the arithmetic type. */
+double foldBuiltin(const Builtin* fn, const vector<double>& nums,
+	precision_t prec);
+
+/* User definitions, shared by every JIT of a machine: their source,
+ * to compile them again in another module or arithmetic type, and
+ * their canonical AST, for the keys of kernels that call them. Read
+ * far more often than written. */
+class DefRegistry {
+	pthread_rwlock_t _lock;
+	StringMap<string> _sources;
+	StringMap<string> _keys;
+
+public:
+	DefRegistry();
+	~DefRegistry();
+
+	/* Calls bind to the first definition of a name, so this fails
+	 * if the name is taken. */
+	bool add(StringRef name, const string& source, const string& key);
+	string source(StringRef name);
+	string key(StringRef name);
+};
+
 struct JIT {
+	LLVMContext* context;
 	Module* mod;
 	IRBuilder<>* builder;
-	map<string, Value*> symbols;
-	Type* float_pod;
-	Type* float_ptr;
-	Type* float_vec;
-	Type* float_vec_const;
+	StringMap<Value*> symbols;
+	StringMap<const Builtin*> builtins;
+	DenseMap<ASTNode*, Value*> emitted;
+	precision_t precision;
+	Type* float_pod;		/* arithmetic scalar */
+	Type* float_ptr;		/* storage element pointer */
+	Type* float_vec;		/* storage vector pointer */
+	Type* float_vec_const;		/* arithmetic vector */
+	Type* store_vec_const;		/* storage vector */
+	unsigned store_bytes;
 	Type* void_ret;
+	IntegerType* size_type;
 	PointerType* result_type;
-	Function* storeu;
-	Function *vsqrt, *vsin, *vcos, *vpow, *vexp, *vlog;
+	Function *vsqrt, *vsin, *vcos, *vpow, *vexp, *vlog, *vfma;
 	FunctionPassManager* optimizer;
+	unsigned inline_threshold;
+	bool quick;			/* skip optimizing, for a first tier */
 	ExecutionEngine* jit;
+	unsigned lanes;
+	math_tier_t math_tier;
+	bool fast_math;
+	double table_error;
+	map<string, pair<double, double> > ranges;
+	map<pair<precision_t, pair<unsigned, unsigned> >, stream_trampoline>
+		trampolines;
+	DefRegistry* defs;
+	jit_stats stats;
+	JITEventListener* listener;
+	size_t code_resident;		/* machine code not yet freed */
+	Value* lane_mask;		/* lanes in range, in a tail */
+	bool crossed;			/* the body so far works across lanes */
+	StringSet<> crossing;		/* definitions that do */
+	double nested_ms;		/* compiling definitions called */
+	DenseMap<GlobalVariable*, void*> tables;	/* and their data */
 
-	JIT();
+	JIT(unsigned _lanes, DefRegistry* _defs);
 	~JIT();
+	void configure(const jit_settings& settings);
 	void* compile(ASTNode* ast);
+	Value* generate(ASTNode* node);
+	Value* generateBody(ASTNode* body);
+	const Builtin* builtin(StringRef name, size_t nargs);
+	void setPrecision(precision_t prec);
+	Value* widen(Value* stored);
+	Value* narrow(Value* val);
+	bool inlineMath();
+	double round(double num);
+	string defName(StringRef name);
+	Function* userFunction(StringRef name);
+	void finish(Function* fn, double start);
+	void inlineCalls(Function* caller);
+	void finalize(Function* fn);
+	void finalize(const vector<Function*>& fns);
+	void setInlineThreshold(unsigned threshold);
+	void* emit(Function* fn);
+	vector<void*> emit(const vector<Function*>& fns);
+	void discard(Function* fn);
+	stream_trampoline streamTrampoline(unsigned nins, unsigned nouts,
+		precision_t prec);
+	string configKey();
+	bool emitObject(Module* m, string path);
 };
+
+/* Evaluates kernel ASTs directly, a block of elements at a time, in
+ * double rounded to the arithmetic type. Calls are resolved against
+ * the JIT up front, so evaluating never touches it. interp.cc */
+class Interpreter {
+public:
+	enum { BLOCK = 256 };
+
+private:
+	/* Values in one call: parameters by name, nodes once each. */
+	struct Frame {
+		StringMap<const double*> vars;
+		DenseMap<ASTNode*, const double*> values;
+	};
+
+	ASTArena& _arena;
+	precision_t _precision;
+	DenseMap<ASTCall*, const Builtin*> _builtins;
+	StringMap<ASTDef*> _defs;
+	vector<double*> _buffers;
+	unsigned _used;
+	size_t _len;
+	Frame* _frame;
+	vector<double> _args;
+
+	bool prepare(JIT* jit, ASTNode* node, DenseMap<ASTNode*, bool>& seen);
+
+public:
+	Interpreter(ASTArena& arena, precision_t precision);
+	~Interpreter();
+
+	/* Checks that 'outs' calls only builtins that fold, and parses
+	 * the definitions they call. Unbound names read as zero. */
+	bool prepare(JIT* jit, const vector<ASTNode*>& outs);
+
+	/* Same arrays and element types as a streaming kernel's. */
+	void run(const vector<ASTNode*>& outs, const vector<string>& params,
+		const float** inputs, float** results, size_t n);
+
+	size_t length() const { return _len; }
+	double* buffer();
+	double round(double num);
+	const double* value(ASTNode* node);
+	const double* variable(StringRef ident);
+	const double* call(ASTCall* call, const vector<const double*>& args);
+};
+
+/* Differentiates expressions in forward mode, building each node's
+ * tangent as another expression over the same parameters, so that a
+ * value and its derivatives compile into one kernel. Calls to
+ * definitions are inlined first. diff.cc */
+class Differentiator {
+	/* Arguments bound to a definition's parameters, and what each
+	 * node of its body became. */
+	struct Scope {
+		StringMap<ASTNode*> vars;
+		DenseMap<ASTNode*, ASTNode*> done;
+	};
+
+	JIT* _jit;
+	ASTArena& _arena;
+	StringMap<ASTDef*> _defs;
+	StringRef _wrt;
+	DenseMap<ASTNode*, ASTNode*> _tangents;	/* NULL for zero */
+	bool _failed;
+
+	ASTDef* definition(StringRef name);
+	ASTNode* expand(ASTNode* node, Scope& scope);
+	ASTNode* number(double num);
+	ASTNode* call(StringRef name, ASTNode* a, ASTNode* b = NULL,
+		ASTNode* c = NULL);
+	ASTNode* add(ASTNode* a, ASTNode* b);
+	ASTNode* sub(ASTNode* a, ASTNode* b);
+	ASTNode* mul(ASTNode* a, ASTNode* b);
+	ASTNode* div(ASTNode* a, ASTNode* b);
+	ASTNode* orZero(ASTNode* tangent);
+	ASTNode* derive(ASTNode* node);
+	ASTNode* deriveCall(ASTCall* node);
+
+public:
+	Differentiator(JIT* jit, ASTArena& arena);
+
+	/* The body of 'defn' with every call to a definition inlined. */
+	ASTNode* expand(ASTDef* defn);
+
+	/* d node / d wrt, for an expanded node. */
+	ASTNode* tangent(ASTNode* node, StringRef wrt);
+
+	/* Whether anything met so far cannot be differentiated. */
+	bool failed() const { return _failed; }
+};
+
+/* A streaming kernel that runs interpreted until native code,
+ * compiled on a background thread, is swapped in. Once hot it is
+ * compiled again with the full pipeline. */
+struct TieredKernel {
+	JITMachine* machine;
+	vector<string> exprs;
+	vector<string> params;
+	ASTArena arena;
+	vector<ASTNode*> outs;
+	Interpreter interp;
+	jit_settings settings;	/* as when the kernel was created */
+	stream_trampoline trampoline;
+	void* volatile native;	/* published after 'trampoline' */
+	void* current;		/* what run_tiered last saw of 'native' */
+	unsigned calls;
+	unsigned tier;		/* 1 quick, 2 optimized; the latest started */
+	pthread_t compiler;
+	bool compiling;
+
+	TieredKernel(JITMachine* _machine, const jit_settings& _settings)
+		: machine(_machine), interp(arena, _settings.precision),
+		  settings(_settings), trampoline(NULL), native(NULL),
+		  current(NULL), calls(0), tier(0), compiling(false)
+	{}
+};
+
+/* vmath.cc */
+Value* vmath_abs(JIT* jit, Value* x);
+Value* vmath_floor(JIT* jit, Value* x);
+Value* vmath_sin(JIT* jit, Value* x);
+Value* vmath_cos(JIT* jit, Value* x);
+Value* vmath_exp(JIT* jit, Value* x);
+Value* vmath_log(JIT* jit, Value* x);
+Value* vmath_pow(JIT* jit, Value* x, Value* y);
+Value* vmath_half_to_float(JIT* jit, Value* h);
+Value* vmath_float_to_half(JIT* jit, Value* x);
+
+/* Links an object file into a shared library with the system
+ * compiler, run directly rather than through a shell. */
+bool link_shared(const string& object, const string& library);
+
+/* table.cc: a copy of 'body' in which the costly functions of ranged
+ * parameters are looked up, within the JIT's error bound. */
+ASTNode* tabulate(JIT* jit, ASTArena& arena, ASTNode* body);
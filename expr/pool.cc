@@ -0,0 +1,130 @@
+/*
+ * pool.cc
+ */
+
+#include <unistd.h>
+
+#include "pool.hh"
+
+struct WorkerArg {
+	ThreadPool* pool;
+	unsigned self;
+};
+
+ThreadPool::ThreadPool(unsigned nthreads)
+	: _task(NULL), _generation(0), _busy(0), _quit(false)
+{
+	if (!nthreads) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = (cpus > 0) ? cpus : 1;
+	}
+	_ranges.resize(nthreads);
+	pthread_mutex_init(&_lock, NULL);
+	pthread_mutex_init(&_running, NULL);
+	pthread_cond_init(&_wake, NULL);
+	pthread_cond_init(&_done, NULL);
+
+	/* Slot 0 belongs to whoever calls run(). */
+	for (unsigned i=1; i < nthreads; ++i) {
+		WorkerArg* arg = new WorkerArg;
+		arg->pool = this;
+		arg->self = i;
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, worker, arg) == 0) {
+			_threads.push_back(thread);
+		} else {
+			delete arg;
+		}
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	pthread_mutex_lock(&_lock);
+	_quit = true;
+	pthread_cond_broadcast(&_wake);
+	pthread_mutex_unlock(&_lock);
+	for (unsigned i=0; i < _threads.size(); ++i) {
+		pthread_join(_threads[i], NULL);
+	}
+	pthread_cond_destroy(&_done);
+	pthread_cond_destroy(&_wake);
+	pthread_mutex_destroy(&_running);
+	pthread_mutex_destroy(&_lock);
+}
+
+void* ThreadPool::worker(void* ptr) {
+	WorkerArg* arg = static_cast<WorkerArg*>(ptr);
+	ThreadPool* pool = arg->pool;
+	unsigned self = arg->self;
+	delete arg;
+
+	size_t seen = 0;
+	pthread_mutex_lock(&pool->_lock);
+	while (true) {
+		while (!pool->_quit && pool->_generation == seen) {
+			pthread_cond_wait(&pool->_wake, &pool->_lock);
+		}
+		if (pool->_quit) break;
+		seen = pool->_generation;
+		pthread_mutex_unlock(&pool->_lock);
+
+		pool->work(self);
+
+		pthread_mutex_lock(&pool->_lock);
+		if (--pool->_busy == 0) {
+			pthread_cond_signal(&pool->_done);
+		}
+	}
+	pthread_mutex_unlock(&pool->_lock);
+	return NULL;
+}
+
+void ThreadPool::work(unsigned self) {
+	unsigned nranges = _ranges.size();
+	for (unsigned k=0; k < nranges; ++k) {
+		Range& range = _ranges[(self + k) % nranges];
+		while (true) {
+			size_t chunk = __sync_fetch_and_add(&range.next, 1);
+			if (chunk >= range.end) break;
+			_task->runChunk(chunk);
+		}
+	}
+}
+
+void ThreadPool::run(PoolTask* task, size_t chunks) {
+	unsigned nranges = _ranges.size();
+
+	/* One task at a time; callers that find the pool busy run their
+	 * own task rather than wait. */
+	bool inline_only = _threads.empty() || chunks < 2
+		|| pthread_mutex_trylock(&_running) != 0;
+	if (inline_only) {
+		for (size_t i=0; i < chunks; ++i) {
+			task->runChunk(i);
+		}
+		return;
+	}
+
+	/* Deal out equal contiguous runs; stealing evens out the rest. */
+	for (unsigned i=0; i < nranges; ++i) {
+		_ranges[i].next = chunks * i / nranges;
+		_ranges[i].end = chunks * (i + 1) / nranges;
+	}
+
+	pthread_mutex_lock(&_lock);
+	_task = task;
+	_busy = _threads.size();
+	++_generation;
+	pthread_cond_broadcast(&_wake);
+	pthread_mutex_unlock(&_lock);
+
+	work(0);
+
+	pthread_mutex_lock(&_lock);
+	while (_busy) {
+		pthread_cond_wait(&_done, &_lock);
+	}
+	_task = NULL;
+	pthread_mutex_unlock(&_lock);
+	pthread_mutex_unlock(&_running);
+}
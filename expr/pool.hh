@@ -0,0 +1,53 @@
+/*
+ * pool.hh
+ */
+
+#pragma once
+
+#include <vector>
+#include <cstddef>
+#include <pthread.h>
+
+using namespace std;
+
+/* Work split into chunks [0, count), run in any order. */
+struct PoolTask {
+	virtual ~PoolTask() {};
+	virtual void runChunk(size_t chunk) = 0;
+};
+
+class ThreadPool {
+	/* Each thread starts on its own contiguous run of chunks and
+	 * steals from the others' runs once it is done. Both owners and
+	 * thieves claim chunks with an atomic increment of 'next'. */
+	struct Range {
+		volatile size_t next;
+		size_t end;
+		char pad[64 - 2 * sizeof(size_t)];
+	};
+
+	vector<pthread_t> _threads;
+	vector<Range> _ranges;
+	pthread_mutex_t _lock;
+	pthread_mutex_t _running;	/* held by the caller of run() */
+	pthread_cond_t _wake;
+	pthread_cond_t _done;
+	PoolTask* _task;
+	size_t _generation;
+	unsigned _busy;
+	bool _quit;
+
+	static void* worker(void* arg);
+	void work(unsigned self);
+
+public:
+	/* Zero threads means one per online CPU. */
+	ThreadPool(unsigned nthreads = 0);
+	~ThreadPool();
+
+	unsigned size() const { return _ranges.size(); }
+
+	/* Blocks until every chunk has run; the caller joins in. Safe
+	 * to call from several threads at once. */
+	void run(PoolTask* task, size_t chunks);
+};
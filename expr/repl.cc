@@ -28,22 +28,79 @@ static string get_expr() {
 	}
 }
 
-static void print_vector(float* result) {
+static void print_vector(float* result, unsigned lanes) {
 	cout << "<";
-	for (int i=0; i < 3; ++i) {
+	for (unsigned i=0; i < lanes - 1; ++i) {
 		cout << result[i] << ", ";
 	}
-	cout << result[3] << ">\n";
+	cout << result[lanes - 1] << ">\n";
+}
+
+static void print_stats(jit_stats stats) {
+	cout << "parse " << stats.parse_ms << " ms, codegen "
+		<< stats.codegen_ms << " ms, optimize " << stats.optimize_ms
+		<< " ms, emit " << stats.emit_ms << " ms\n";
+	cout << stats.functions << " function(s), " << stats.ir_before
+		<< " -> " << stats.ir_after << " IR instructions, "
+		<< stats.code_bytes << " bytes of machine code\n";
 }
 
 int main(int argc, const char* argv[]) {
-	float result[4];
+	float result[16];
 	bool do_emit = false;
-	if (argc > 1 && string(argv[1]) == "-emit") {
-		do_emit = true;
+	bool do_stats = false;
+	unsigned lanes = 0;
+	math_tier_t tier = MATH_LIBM;
+	bool fast_math = false;
+	int inline_threshold = -1;
+	bool tiered = false;
+	string load;
+	for (int i=1; i < argc; ++i) {
+		string arg = argv[i];
+		if (arg == "-emit") {
+			do_emit = true;
+		} else if (arg == "-stats") {
+			do_stats = true;
+		} else if (arg == "-lanes" && i + 1 < argc) {
+			lanes = atoi(argv[++i]);
+		} else if (arg == "-inline" && i + 1 < argc) {
+			inline_threshold = atoi(argv[++i]);
+		} else if (arg == "-load" && i + 1 < argc) {
+			load = argv[++i];
+		} else if (arg == "-tiered") {
+			tiered = true;
+		} else if (arg == "-fast-math") {
+			fast_math = true;
+		} else if (arg == "-math" && i + 1 < argc) {
+			string mode = argv[++i];
+			if (mode == "precise") {
+				tier = MATH_PRECISE;
+			} else if (mode == "fast") {
+				tier = MATH_FAST;
+			}
+		}
 	}
 
-	JITMachine machine;
+	JITMachine machine(lanes);
+	machine.set_math_tier(tier);
+	machine.set_fast_math(fast_math);
+	if (inline_threshold >= 0) {
+		machine.set_inline_threshold(inline_threshold);
+	}
+	lanes = machine.jit->lanes;
+
+	/* Only the definitions are wanted here, not their kernels. */
+	if (!load.empty()) {
+		map<string, void*> loaded = machine.load_file(load);
+		if (loaded.empty()) {
+			cerr << load << ": nothing loaded" << endl;
+		}
+		map<string, void*>::iterator it = loaded.begin();
+		for (; it != loaded.end(); ++it) {
+			machine.release_kernel(it->second);
+		}
+	}
+	vector<TieredKernel*> kernels;
 
 	while (true) {
 		string expr = get_expr();
@@ -53,18 +110,47 @@ int main(int argc, const char* argv[]) {
 			break;
 		}
 
+		/* Tiered compiles outlive the line that started them, so
+		 * their stats add up from the start instead. */
+		if (!tiered) {
+			machine.reset_stats();
+		}
+
+		/* Answer from the interpreter; the kernel compiles while
+		 * the next line is typed. Definitions fall through. */
+		TieredKernel* kernel = tiered ? machine.jit_tiered_exprs(
+			vector<string>(1, expr), vector<string>()) : NULL;
+		if (kernel) {
+			machine.run_tiered(kernel, vector<const float*>(),
+				vector<float*>(1, result), lanes);
+			print_vector(result, lanes);
+			if (do_stats) {
+				print_stats(machine.stats());
+			}
+			kernels.push_back(kernel);
+			continue;
+		}
+
 		void* fn = machine.jit_repl_expr(expr);
 		if (do_emit) {
 			machine.jit->mod->dump();
 		}
+		if (do_stats) {
+			print_stats(machine.stats());
+		}
 
 		if (fn) {
 			apply_jit_func func = apply_jit_func(fn);
 			func(result);
-			print_vector(result);
+			print_vector(result, lanes);
+			machine.release_kernel(fn);
 		}
 	}
 
+	for (unsigned i=0; i < kernels.size(); ++i) {
+		machine.free_tiered(kernels[i]);
+	}
+
 	custom_func magic = custom_func(machine.jit_external(
 		"(def magic (x y)"
 		"  (* (/ (sin x)"
@@ -75,14 +161,20 @@ int main(int argc, const char* argv[]) {
 		machine.jit->mod->dump();
 	}
 	cout << "Calling magic...\n";
-	float x[] = {.25, .75, 1.25, 1.75};
-	float y[] = {1.0, 2.0, 4.50, 11.5};
+	float x[16], y[16];
+	const float xs[] = {.25, .75, 1.25, 1.75};
+	const float ys[] = {1.0, 2.0, 4.50, 11.5};
+	for (unsigned i=0; i < lanes; ++i) {
+		x[i] = xs[i % 4];
+		y[i] = ys[i % 4];
+	}
 	magic(x, y, result);
 	cout << "x = ";
-	print_vector(x);
+	print_vector(x, lanes);
 	cout << "y = ";
-	print_vector(y);
+	print_vector(y, lanes);
 	cout << "Result = ";
-	print_vector(result);
+	print_vector(result, lanes);
+	machine.release_kernel((void*) magic);
 	return 0;
 }
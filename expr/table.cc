@@ -0,0 +1,278 @@
+/*
+ * table.cc
+ *
+ * Replaces costly functions of one ranged parameter by interpolation
+ * in a table computed at compile time.
+ */
+
+#include "lang.hh"
+
+/* Entries tried, doubling, before a function is left alone. */
+static const size_t min_entries = 16;
+static const size_t max_entries = 1 << 16;
+
+/* Whether 'node' is a function of one parameter at most, built from
+ * builtins that fold; 'var' collects the parameter, and 'costly'
+ * whether any call is worth a table. */
+static bool univariate(JIT* jit, ASTNode* node, ASTVar*& var,
+	bool& costly)
+{
+	if (dynamic_cast<ASTNumber*>(node)) {
+		return true;
+	}
+	ASTVar* ref = dynamic_cast<ASTVar*>(node);
+	if (ref) {
+		if (!var) {
+			var = ref;
+		}
+		return var->ident == ref->ident;
+	}
+	ASTCall* call = dynamic_cast<ASTCall*>(node);
+	const Builtin* builtin = call
+		? jit->builtin(call->name, call->args.size()) : NULL;
+	if (!builtin || !builtin->fold) {
+		return false;
+	}
+	StringRef name = call->name;
+	costly = costly || name == "sin" || name == "cos" || name == "exp"
+		|| name == "log" || name == "pow";
+	ASTCall::arg_list::iterator it = call->args.begin();
+	for (; it != call->args.end(); ++it) {
+		if (!univariate(jit, *it, var, costly)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Comparisons give lane masks, which tables cannot hold. */
+static bool isMask(ASTNode* node) {
+	ASTCall* call = dynamic_cast<ASTCall*>(node);
+	if (!call) {
+		return false;
+	}
+	StringRef name = call->name;
+	return name == "<" || name == "<=" || name == ">" || name == ">="
+		|| name == "=" || name == "!=";
+}
+
+/* In double, as the exact value the table stands in for. */
+static double evaluate(JIT* jit, ASTNode* node, double x) {
+	ASTNumber* num = dynamic_cast<ASTNumber*>(node);
+	if (num) {
+		return num->num;
+	}
+	ASTCall* call = dynamic_cast<ASTCall*>(node);
+	if (!call) {
+		return x;
+	}
+	vector<double> args;
+	ASTCall::arg_list::iterator it = call->args.begin();
+	for (; it != call->args.end(); ++it) {
+		args.push_back(evaluate(jit, *it, x));
+	}
+	return jit->builtin(call->name, args.size())->fold(args);
+}
+
+/* Points checked inside each interval, and the share of the error
+ * bound they must keep to, leaving the rest for peaks between them. */
+static const unsigned checks = 8;
+static const double check_margin = 0.75;
+
+/* Interpolates 'table' at 'x' as ASTTable::codeGen does, rounding
+ * each step to the arithmetic type. */
+static double interpolate(JIT* jit, const vector<double>& table,
+	double lo, double scale, double x)
+{
+	double last = table.size() - 1;
+	double pos = jit->round(jit->round(x - jit->round(lo)) * scale);
+	pos = min(max(pos, 0.0), last);
+	size_t idx = min(size_t(pos), table.size() - 2);
+	double frac = jit->round(pos - idx);
+	double diff = jit->round(table[idx + 1] - table[idx]);
+	return jit->round(table[idx] + jit->round(frac * diff));
+}
+
+/* Doubles the table until interpolating between entries, as the
+ * kernel will, stays within the error bound across each interval.
+ * Fails if the function is not finite over the range. */
+static bool buildTable(JIT* jit, ASTNode* node, double lo, double hi,
+	vector<double>& table)
+{
+	for (size_t n=min_entries; n <= max_entries; n *= 2) {
+		double step = (hi - lo) / (n - 1);
+		table.resize(n);
+		for (size_t i=0; i < n; ++i) {
+			table[i] = jit->round(evaluate(jit, node, lo + i * step));
+			if (!isfinite(table[i])) {
+				return false;
+			}
+		}
+
+		double scale = jit->round((n - 1) / (hi - lo));
+		double bound = jit->table_error * check_margin;
+		bool within = true;
+		for (size_t i=0; within && i + 1 < n; ++i) {
+			for (unsigned q=0; within && q <= checks; ++q) {
+				double at = jit->round(lo + (i + q / double(checks))
+					* step);
+				at = min(max(at, lo), hi);
+				double exact = evaluate(jit, node, at);
+				double approx = interpolate(jit, table, lo, scale, at);
+				within = fabs(exact - approx) <= bound;
+			}
+		}
+		if (within) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static ASTNode* tabulate(JIT* jit, ASTArena& arena, ASTNode* node,
+	DenseMap<ASTNode*, ASTNode*>& done)
+{
+	DenseMap<ASTNode*, ASTNode*>::iterator found = done.find(node);
+	if (found != done.end()) {
+		return found->second;
+	}
+
+	/* The largest subtrees that qualify are replaced whole. */
+	ASTVar* var = NULL;
+	bool costly = false;
+	if (univariate(jit, node, var, costly) && var && costly
+		&& !isMask(node) && jit->ranges.count(var->ident.str()))
+	{
+		pair<double, double> range = jit->ranges[var->ident.str()];
+		vector<double> table;
+		if (range.first < range.second
+			&& buildTable(jit, node, range.first, range.second, table))
+		{
+			ASTTable* lookup = new (arena) ASTTable(var, range.first,
+				range.second);
+			lookup->values = table;
+			done[node] = lookup;
+			return lookup;
+		}
+	}
+
+	ASTNode* result = node;
+	ASTCall* call = dynamic_cast<ASTCall*>(node);
+	ASTTuple* tuple = dynamic_cast<ASTTuple*>(node);
+	if (call) {
+		ASTCall* copy = new (arena) ASTCall(call->name);
+		bool changed = false;
+		ASTCall::arg_list::iterator it = call->args.begin();
+		for (; it != call->args.end(); ++it) {
+			copy->args.push_back(tabulate(jit, arena, *it, done));
+			changed = changed || copy->args.back() != *it;
+		}
+		result = changed ? copy : node;
+	} else if (tuple) {
+		ASTTuple* copy = new (arena) ASTTuple();
+		for (unsigned k=0; k < tuple->elts.size(); ++k) {
+			copy->elts.push_back(tabulate(jit, arena, tuple->elts[k],
+				done));
+		}
+		result = copy;
+	}
+	done[node] = result;
+	return result;
+}
+
+ASTNode* tabulate(JIT* jit, ASTArena& arena, ASTNode* body) {
+	DenseMap<ASTNode*, ASTNode*> done;
+	return tabulate(jit, arena, body, done);
+}
+
+void ASTTable::canonical(ASTKey& key) {
+	key.text += "(table " + utohexstr(DoubleToBits(lo)) + " "
+		+ utohexstr(DoubleToBits(hi)) + " " + utostr(values.size())
+		+ " ";
+	arg->canonical(key);
+	key.text += ")";
+}
+
+/* The initializer serves objects written out; the engine reads the
+ * data from memory of our own, which goes with the last function
+ * that uses it (see JIT::discard). */
+GlobalVariable* ASTTable::newTable(JIT* jit) {
+	unsigned n = values.size();
+	bool wide = jit->float_pod->isDoubleTy();
+	vector<Constant*> elts;
+	for (unsigned i=0; i < n; ++i) {
+		elts.push_back(ConstantFP::get(jit->float_pod, values[i]));
+	}
+	ArrayType* type = ArrayType::get(jit->float_pod, n);
+	GlobalVariable* table = new GlobalVariable(*jit->mod, type, true,
+		GlobalValue::InternalLinkage, ConstantArray::get(type, elts),
+		"table");
+	if (!jit->jit) {
+		return table;
+	}
+
+	void* data = malloc(n * (wide ? sizeof(double) : sizeof(float)));
+	for (unsigned i=0; i < n; ++i) {
+		if (wide) {
+			static_cast<double*>(data)[i] = values[i];
+		} else {
+			static_cast<float*>(data)[i] = values[i];
+		}
+	}
+	jit->jit->addGlobalMapping(table, data);
+	jit->tables[table] = data;
+	return table;
+}
+
+Value* ASTTable::codeGen(JIT* jit) {
+	Value* x = jit->generate(arg);
+	if (!x) return NULL;
+
+	IRBuilder<>* builder = jit->builder;
+	Type* vec = jit->float_vec_const;
+	unsigned n = values.size();
+	if (!global || global->getParent() != jit->mod) {
+		global = newTable(jit);
+	}
+	Value* base = builder->CreateBitCast(global,
+		PointerType::get(jit->float_pod, 0));
+
+	/* Position in the table, clamped to its ends; buildTable checks
+	 * these steps, rounded alike. */
+	Value* zero = ConstantFP::get(vec, 0.0);
+	Value* last = ConstantFP::get(vec, n - 1);
+	Value* pos = builder->CreateFMul(
+		builder->CreateFSub(x, ConstantFP::get(vec, lo)),
+		ConstantFP::get(vec, (n - 1) / (hi - lo)));
+	pos = builder->CreateSelect(builder->CreateFCmpOGT(pos, zero),
+		pos, zero);
+	pos = builder->CreateSelect(builder->CreateFCmpOLT(pos, last),
+		pos, last);
+
+	Type* lane_type = Type::getInt32Ty(jit->mod->getContext());
+	Type* idx_type = VectorType::get(lane_type, jit->lanes);
+	Value* top = ConstantInt::get(idx_type, n - 2);
+	Value* idx = builder->CreateFPToSI(pos, idx_type);
+	idx = builder->CreateSelect(builder->CreateICmpSLT(idx, top), idx, top);
+	Value* frac = builder->CreateFSub(pos,
+		builder->CreateSIToFP(idx, vec));
+
+	/* The entries either side, one lane at a time. */
+	Value* left = UndefValue::get(vec);
+	Value* right = UndefValue::get(vec);
+	for (unsigned j=0; j < jit->lanes; ++j) {
+		Value* lane = ConstantInt::get(lane_type, j);
+		Value* at = builder->CreateInBoundsGEP(base,
+			builder->CreateExtractElement(idx, lane));
+		left = builder->CreateInsertElement(left,
+			builder->CreateLoad(at), lane);
+		right = builder->CreateInsertElement(right,
+			builder->CreateLoad(builder->CreateInBoundsGEP(at,
+				ConstantInt::get(lane_type, 1))), lane);
+	}
+	Value* r = builder->CreateFAdd(left,
+		builder->CreateFMul(frac, builder->CreateFSub(right, left)));
+
+	/* NaN would clamp to the first entry; it stays NaN instead. */
+	return builder->CreateSelect(builder->CreateFCmpUNO(x, x), x, r);
+}
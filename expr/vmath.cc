@@ -0,0 +1,333 @@
+/*
+ * vmath.cc
+ *
+ * Vectorized transcendentals, emitted inline as IR. Range reduction
+ * and polynomials follow Cephes; MATH_PRECISE stays within 2 ulp,
+ * MATH_FAST drops to short minimax polynomials good to about 1e-4.
+ * sin and cos leave arguments past 8192 to libm, and pow, which only
+ * MATH_FAST inlines, is off by about 1e-4 times |y log|x|| relative.
+ */
+
+#include "lang.hh"
+
+/* Integers as wide as the arithmetic type, for bit manipulation. */
+static Type* int_vec(JIT* jit) {
+	return VectorType::get(IntegerType::get(jit->mod->getContext(),
+		jit->float_pod->getPrimitiveSizeInBits()), jit->lanes);
+}
+
+static Constant* fsplat(JIT* jit, double c) {
+	return ConstantFP::get(jit->float_vec_const, c);
+}
+
+static Constant* isplat(JIT* jit, uint64_t c) {
+	return ConstantInt::get(int_vec(jit), c);
+}
+
+static Value* as_int(JIT* jit, Value* v) {
+	return jit->builder->CreateBitCast(v, int_vec(jit));
+}
+
+static Value* as_float(JIT* jit, Value* v) {
+	return jit->builder->CreateBitCast(v, jit->float_vec_const);
+}
+
+/* c[0] * x^(n-1) + ... + c[n-1] */
+static Value* horner(JIT* jit, Value* x, const float* c, unsigned n) {
+	Value* acc = fsplat(jit, c[0]);
+	for (unsigned i=1; i < n; ++i) {
+		acc = jit->builder->CreateFAdd(jit->builder->CreateFMul(acc, x),
+			fsplat(jit, c[i]));
+	}
+	return acc;
+}
+
+Value* vmath_abs(JIT* jit, Value* x) {
+	unsigned bits = jit->float_pod->getPrimitiveSizeInBits();
+	return as_float(jit, jit->builder->CreateAnd(as_int(jit, x),
+		ConstantInt::get(int_vec(jit), APInt::getSignedMaxValue(bits))));
+}
+
+Value* vmath_floor(JIT* jit, Value* x) {
+	IRBuilder<>* b = jit->builder;
+	Value* t = b->CreateSIToFP(b->CreateFPToSI(x, int_vec(jit)),
+		jit->float_vec_const);
+	t = b->CreateFSub(t, b->CreateSelect(b->CreateFCmpOGT(t, x),
+		fsplat(jit, 1.0), fsplat(jit, 0.0)));
+
+	/* Past 2^23 (2^52 for doubles) every value is integral, and
+	 * fptosi may overflow. */
+	int digits = jit->float_pod->isDoubleTy() ? 52 : 23;
+	Value* exact = b->CreateFCmpUGE(vmath_abs(jit, x),
+		fsplat(jit, ldexp(1.0, digits)));
+	return b->CreateSelect(exact, x, t);
+}
+
+static const float sin_precise[] = {
+	-1.9515295891e-4, 8.3321608736e-3, -1.6666654611e-1 };
+static const float cos_precise[] = {
+	2.443315711809948e-5, -1.388731625493765e-3, 4.166664568298827e-2 };
+static const float sin_fast[] = { 8.2119203e-3, -1.6665733e-1 };
+static const float cos_fast[] = { 4.0397956e-2, -4.9970778e-1, 9.9999001e-1 };
+
+static Value* vmath_sincos(JIT* jit, Value* x, bool cosine) {
+	IRBuilder<>* b = jit->builder;
+	bool fast = (jit->math_tier == MATH_FAST);
+
+	/* Reduce |x| to [-pi/4, pi/4] and find its octant j. */
+	Value* xi = as_int(jit, x);
+	Value* sign = cosine ? isplat(jit, 0)
+		: b->CreateAnd(xi, isplat(jit, 0x80000000));
+	x = vmath_abs(jit, x);
+	Value* j = b->CreateFPToSI(b->CreateFMul(x,
+		fsplat(jit, 1.27323954473516)), int_vec(jit));
+	j = b->CreateAnd(b->CreateAdd(j, isplat(jit, 1)), isplat(jit, ~1u));
+	Value* y = b->CreateSIToFP(j, jit->float_vec_const);
+
+	Value* flip;
+	if (cosine) {
+		j = b->CreateSub(j, isplat(jit, 2));
+		flip = b->CreateAnd(b->CreateNot(j), isplat(jit, 4));
+	} else {
+		flip = b->CreateAnd(j, isplat(jit, 4));
+	}
+	sign = b->CreateXor(sign, b->CreateShl(flip, isplat(jit, 29)));
+	Value* use_sin = b->CreateICmpEQ(b->CreateAnd(j, isplat(jit, 2)),
+		isplat(jit, 0));
+
+	/* pi/4 split in three so the products are exact, in both tiers:
+	 * one constant would lose about 5e-4 near 8192. */
+	x = b->CreateFSub(x, b->CreateFMul(y, fsplat(jit, 0.78515625)));
+	x = b->CreateFSub(x, b->CreateFMul(y,
+		fsplat(jit, 2.4187564849853515625e-4)));
+	x = b->CreateFSub(x, b->CreateFMul(y,
+		fsplat(jit, 3.77489497744594108e-8)));
+	Value* z = b->CreateFMul(x, x);
+
+	Value *sinp, *cosp;
+	if (fast) {
+		sinp = horner(jit, z, sin_fast, 2);
+		cosp = horner(jit, z, cos_fast, 3);
+	} else {
+		sinp = horner(jit, z, sin_precise, 3);
+		cosp = horner(jit, z, cos_precise, 3);
+		cosp = b->CreateFMul(b->CreateFMul(cosp, z), z);
+		cosp = b->CreateFSub(cosp, b->CreateFMul(z, fsplat(jit, 0.5)));
+		cosp = b->CreateFAdd(cosp, fsplat(jit, 1.0));
+	}
+	sinp = b->CreateFAdd(b->CreateFMul(b->CreateFMul(sinp, z), x), x);
+
+	Value* r = b->CreateSelect(use_sin, sinp, cosp);
+	return as_float(jit, b->CreateXor(as_int(jit, r), sign));
+}
+
+/* Reducing by pi/4 in three parts is exact while j * 0.78515625 is,
+ * up to about 8192 (Cephes' lossth); past that, and for NaN and inf,
+ * vectors with any such lane branch to libm for them. */
+static Value* outOfRange(JIT* jit, Value* x, Value* r, Function* libm) {
+	IRBuilder<>* b = jit->builder;
+	LLVMContext& ctx = jit->mod->getContext();
+	Value* wide = b->CreateFCmpUGT(vmath_abs(jit, x), fsplat(jit, 8192.0));
+	Type* bits = IntegerType::get(ctx, jit->lanes);
+	Value* any = b->CreateICmpNE(b->CreateBitCast(wide, bits),
+		ConstantInt::get(bits, 0));
+
+	BasicBlock* from = b->GetInsertBlock();
+	BasicBlock* slow = BasicBlock::Create(ctx, "libm", from->getParent());
+	BasicBlock* join = BasicBlock::Create(ctx, "reduced",
+		from->getParent());
+	b->CreateCondBr(any, slow, join);
+	b->SetInsertPoint(slow);
+	Value* exact = b->CreateSelect(wide, b->CreateCall(libm, x), r);
+	b->CreateBr(join);
+
+	b->SetInsertPoint(join);
+	PHINode* phi = b->CreatePHI(jit->float_vec_const, 2);
+	phi->addIncoming(r, from);
+	phi->addIncoming(exact, slow);
+	return phi;
+}
+
+Value* vmath_sin(JIT* jit, Value* x) {
+	return outOfRange(jit, x, vmath_sincos(jit, x, false), jit->vsin);
+}
+
+Value* vmath_cos(JIT* jit, Value* x) {
+	return outOfRange(jit, x, vmath_sincos(jit, x, true), jit->vcos);
+}
+
+static const float exp_precise[] = {
+	1.9875691500e-4, 1.3981999507e-3, 8.3334519073e-3,
+	4.1665795894e-2, 1.6666665459e-1, 5.0000001201e-1 };
+static const float exp_fast[] = {
+	1.6541924e-1, 5.0494855e-1, 1.0001862, 9.9992894e-1 };
+
+Value* vmath_exp(JIT* jit, Value* x) {
+	IRBuilder<>* b = jit->builder;
+	bool fast = (jit->math_tier == MATH_FAST);
+
+	/* ln(FLT_MAX), and ln of the least denormal; past them the
+	 * result is inf or 0. */
+	Value* in = x;
+	Constant* hi = fsplat(jit, 88.7228391116729996);
+	Constant* lo = fsplat(jit, -103.972077083991796);
+	x = b->CreateSelect(b->CreateFCmpOGT(x, hi), hi, x);
+	x = b->CreateSelect(b->CreateFCmpOLT(x, lo), lo, x);
+
+	/* e^x = 2^n * e^r, with |r| <= ln(2) / 2 */
+	Value* n = vmath_floor(jit, b->CreateFAdd(b->CreateFMul(x,
+		fsplat(jit, 1.44269504088896341)), fsplat(jit, 0.5)));
+	Value* y;
+	if (fast) {
+		x = b->CreateFSub(x, b->CreateFMul(n,
+			fsplat(jit, 0.69314718055994531)));
+		y = horner(jit, x, exp_fast, 4);
+	} else {
+		x = b->CreateFSub(x, b->CreateFMul(n, fsplat(jit, 0.693359375)));
+		x = b->CreateFSub(x, b->CreateFMul(n,
+			fsplat(jit, -2.12194440e-4)));
+		y = horner(jit, x, exp_precise, 6);
+		y = b->CreateFMul(y, b->CreateFMul(x, x));
+		y = b->CreateFAdd(b->CreateFAdd(y, x), fsplat(jit, 1.0));
+	}
+
+	/* n spans [-150, 128], past the exponent field's reach, so 2^n
+	 * is built in two halves that each are normal floats. */
+	Value* ni = b->CreateFPToSI(n, int_vec(jit));
+	Value* half = b->CreateAShr(ni, isplat(jit, 1));
+	Value* e1 = as_float(jit, b->CreateShl(b->CreateAdd(half,
+		isplat(jit, 127)), isplat(jit, 23)));
+	Value* e2 = as_float(jit, b->CreateShl(b->CreateAdd(
+		b->CreateSub(ni, half), isplat(jit, 127)), isplat(jit, 23)));
+	Value* r = b->CreateFMul(b->CreateFMul(y, e1), e2);
+
+	r = b->CreateSelect(b->CreateFCmpOGT(in, hi), fsplat(jit, HUGE_VAL), r);
+	return b->CreateSelect(b->CreateFCmpOLT(in, lo), fsplat(jit, 0.0), r);
+}
+
+static const float log_precise[] = {
+	7.0376836292e-2, -1.1514610310e-1, 1.1676998740e-1,
+	-1.2420140846e-1, 1.4249322787e-1, -1.6668057665e-1,
+	2.0000714765e-1, -2.4999993993e-1, 3.3333331174e-1 };
+static const float log_fast[] = {
+	1.8232826e-1, -2.6773501e-1, 3.3495923e-1, -4.9974956e-1 };
+
+Value* vmath_log(JIT* jit, Value* x) {
+	IRBuilder<>* b = jit->builder;
+	bool fast = (jit->math_tier == MATH_FAST);
+	Value* in = x;
+
+	/* x = m * 2^e, with m in [sqrt(1/2), sqrt(2)); denormals are
+	 * scaled by 2^23 into range first. */
+	Value* denormal = b->CreateFCmpOLT(x, fsplat(jit, 1.17549435e-38));
+	x = b->CreateSelect(denormal, b->CreateFMul(x,
+		fsplat(jit, ldexp(1.0, 23))), x);
+	Value* xi = as_int(jit, x);
+	Value* e = b->CreateSIToFP(b->CreateSub(b->CreateLShr(xi,
+		isplat(jit, 23)), isplat(jit, 126)), jit->float_vec_const);
+	e = b->CreateFSub(e, b->CreateSelect(denormal, fsplat(jit, 23.0),
+		fsplat(jit, 0.0)));
+	Value* m = as_float(jit, b->CreateOr(b->CreateAnd(xi,
+		isplat(jit, 0x807fffff)), isplat(jit, 0x3f000000)));
+	Value* small = b->CreateFCmpOLT(m, fsplat(jit, 0.707106781186547524));
+	e = b->CreateFSub(e, b->CreateSelect(small, fsplat(jit, 1.0),
+		fsplat(jit, 0.0)));
+	x = b->CreateFSub(m, fsplat(jit, 1.0));
+	x = b->CreateFAdd(x, b->CreateSelect(small, m, fsplat(jit, 0.0)));
+	Value* z = b->CreateFMul(x, x);
+
+	Value* r;
+	if (fast) {
+		r = b->CreateFMul(horner(jit, x, log_fast, 4), z);
+		r = b->CreateFAdd(x, r);
+		r = b->CreateFAdd(r, b->CreateFMul(e,
+			fsplat(jit, 0.69314718055994531)));
+	} else {
+		Value* y = horner(jit, x, log_precise, 9);
+		y = b->CreateFMul(b->CreateFMul(y, x), z);
+		y = b->CreateFAdd(y, b->CreateFMul(e,
+			fsplat(jit, -2.12194440e-4)));
+		y = b->CreateFSub(y, b->CreateFMul(z, fsplat(jit, 0.5)));
+		r = b->CreateFAdd(x, y);
+		r = b->CreateFAdd(r, b->CreateFMul(e, fsplat(jit, 0.693359375)));
+	}
+
+	/* log(0) = -inf, log(inf) = inf, log(x < 0) = log(nan) = nan */
+	r = b->CreateSelect(b->CreateFCmpOEQ(in, fsplat(jit, 0.0)),
+		fsplat(jit, -HUGE_VAL), r);
+	r = b->CreateSelect(b->CreateFCmpOEQ(in, fsplat(jit, HUGE_VAL)),
+		in, r);
+	return b->CreateSelect(b->CreateFCmpULT(in, fsplat(jit, 0.0)),
+		fsplat(jit, NAN), r);
+}
+
+Value* vmath_pow(JIT* jit, Value* x, Value* y) {
+	IRBuilder<>* b = jit->builder;
+	Value* r = vmath_exp(jit, b->CreateFMul(y,
+		vmath_log(jit, vmath_abs(jit, x))));
+
+	/* A negative base needs an integral exponent; odd ones flip. */
+	Value* whole = vmath_floor(jit, y);
+	Value* integral = b->CreateFCmpOEQ(whole, y);
+	Value* half = vmath_floor(jit, b->CreateFMul(y, fsplat(jit, 0.5)));
+	Value* odd = b->CreateFCmpUNE(b->CreateFAdd(half, half), whole);
+	Value* neg = b->CreateFCmpOLT(x, fsplat(jit, 0.0));
+	r = b->CreateSelect(b->CreateAnd(neg, odd), b->CreateFNeg(r), r);
+	r = b->CreateSelect(b->CreateAnd(neg, b->CreateNot(integral)),
+		fsplat(jit, NAN), r);
+	return b->CreateSelect(b->CreateFCmpOEQ(y, fsplat(jit, 0.0)),
+		fsplat(jit, 1.0), r);
+}
+
+/* Half floats have no vector conversions to lean on, so they are
+ * widened and narrowed with integer operations on float bits. */
+Value* vmath_half_to_float(JIT* jit, Value* h) {
+	IRBuilder<>* b = jit->builder;
+	Value* x = b->CreateZExt(h, int_vec(jit));
+	Value* sign = b->CreateShl(b->CreateAnd(x, isplat(jit, 0x8000)),
+		isplat(jit, 16));
+	Value* em = b->CreateShl(b->CreateAnd(x, isplat(jit, 0x7fff)),
+		isplat(jit, 13));
+
+	/* Rebiasing by a multiply is exact for subnormals too. */
+	Value* finite = as_int(jit, b->CreateFMul(as_float(jit, em),
+		fsplat(jit, ldexp(1.0, 112))));
+
+	/* Infinities and NaNs keep an all-ones exponent. */
+	Value* special = b->CreateICmpUGE(em, isplat(jit, 0x7c00 << 13));
+	Value* bits = b->CreateSelect(special,
+		b->CreateOr(em, isplat(jit, 0x7f800000)), finite);
+	return as_float(jit, b->CreateOr(bits, sign));
+}
+
+/* Rounds to nearest even, overflowing to infinity. */
+Value* vmath_float_to_half(JIT* jit, Value* x) {
+	IRBuilder<>* b = jit->builder;
+	Value* u = as_int(jit, x);
+	Value* sign = b->CreateAnd(u, isplat(jit, 0x80000000));
+	u = b->CreateXor(u, sign);
+
+	/* At least 2^16 is infinity; NaNs stay quiet NaNs. */
+	Value* huge = b->CreateSelect(
+		b->CreateICmpUGT(u, isplat(jit, 0x7f800000)),
+		isplat(jit, 0x7e00), isplat(jit, 0x7c00));
+
+	/* Below 2^-14 the result is subnormal: adding 0.5 lines the
+	 * half's mantissa up with the float's, and rounds it. */
+	Value* magic = isplat(jit, 126 << 23);
+	Value* tiny = b->CreateSub(as_int(jit, b->CreateFAdd(as_float(jit, u),
+		as_float(jit, magic))), magic);
+
+	/* Otherwise rebias the exponent and round the mantissa. */
+	Value* odd = b->CreateAnd(b->CreateLShr(u, isplat(jit, 13)),
+		isplat(jit, 1));
+	Value* normal = b->CreateLShr(b->CreateAdd(b->CreateAdd(u,
+		isplat(jit, 0xc8000fff)), odd), isplat(jit, 13));
+
+	Value* h = b->CreateSelect(b->CreateICmpULT(u, isplat(jit, 113 << 23)),
+		tiny, normal);
+	h = b->CreateSelect(b->CreateICmpUGE(u, isplat(jit, 143 << 23)),
+		huge, h);
+	h = b->CreateOr(h, b->CreateLShr(sign, isplat(jit, 16)));
+	return b->CreateTrunc(h, jit->store_vec_const);
+}